@@ -0,0 +1,518 @@
+//==============================================================================
+//  NPEHAnalysis.h
+//
+//  The NPE-h template analysis proper: histogram booking and the
+//  per-event analysis of an eventSnapshot_t. Nothing in here knows
+//  about Pythia, so the same code runs inside the generator
+//  (NPEHDelPhiCorr), on saved event records and on HepMC files
+//  (NPEHReplay).
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#ifndef NPEHAnalysis_h
+#define NPEHAnalysis_h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <sys/resource.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "TH2D.h"
+#include "TH3F.h"
+#include "NPEHEventRecord.h"
+
+//
+//  Output of the delta-phi kernel for one trigger: number of
+//  near-/away-side hadrons and their summed pT.
+//
+struct pairSums_t {
+  int nnear;
+  int naway;
+  double ptNear;
+  double ptAway;
+};
+
+//
+//  One set of acceptance cuts. Every cut set gets its own family
+//  of histograms, all filled from the same events.
+//
+struct cutSet_t {
+  double maxEtaE;      // electron |eta|
+  double maxEtaH;      // hadron |eta|
+  double ptMinH;       // hadron candidates: pT above
+  double ptMinAssoc;   // delta-phi and near/away histograms: pT from
+};
+
+const int kHistos2DPerSet = 10;   // histos2D[k*kHistos2DPerSet + i] belongs to cut set k
+const int kHistos3DPerSet = 2;
+
+//
+//  Where the time goes. Each phase is timed as a whole (per
+//  event or per trigger), so the clock is read a few times per
+//  event only. Counters and times of several threads or
+//  processes simply add up.
+//
+struct perfCounters_t {
+  enum phase_t {kGenerate, kSnapshot, kSelect, kPairs, kFill, kOutput, kNPhases};
+  perfCounters_t() {reset();}
+  void reset() {
+    for (int k = 0; k < kNPhases; k++) seconds[k] = 0;
+    wall = 0;
+    events = accepted = triggers = pairs = 0;
+  }
+  void add(const perfCounters_t &other) {
+    for (int k = 0; k < kNPhases; k++) seconds[k] += other.seconds[k];
+    wall += other.wall;
+    events += other.events;
+    accepted += other.accepted;
+    triggers += other.triggers;
+    pairs += other.pairs;
+  }
+  static const char* phaseName(int k) {
+    static const char* names[kNPhases] = {"generate", "snapshot", "select", "pairs", "fill", "output"};
+    return names[k];
+  }
+  double seconds[kNPhases];
+  double wall;       // elapsed time of the loop(s)
+  long events;       // generated
+  long accepted;     // with a c/b electron in the acceptance
+  long triggers;     // c/b electrons in the acceptance
+  long pairs;        // trigger-hadron pairs
+};
+
+inline double perfClock()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + 1e-9*now.tv_nsec;
+}
+
+// peak resident memory of this process in MB
+inline double peakRSS()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss/1024.;
+}
+
+//
+//  Flavor of a hadron from its PDG code: c (b) hadrons start
+//  with 4 (5). Note that this includes quarkonia.
+//
+inline int hfFlavor(int id)
+{
+  id = abs(id);
+  if (id == 0) return 0;
+  return static_cast<int>(id/pow(10.,static_cast<int>(log10(id))));
+}
+
+//
+//  Acceptance filter
+//
+inline bool isInAcceptanceE(int i, const eventSnapshot_t& ev, const cutSet_t &cuts)
+{
+  // accept all (useful for many studies)
+  //  return true;
+    
+  // limit to STAR TPC/BEMC/ToF acceptance (default |eta| < 0.7)
+  double eta = ev.eta[i];
+  if (fabs(eta) < cuts.maxEtaE)
+      return true;
+  else
+      return false;
+}
+
+inline bool isInAcceptanceH(int i, const eventSnapshot_t& ev, const cutSet_t &cuts)
+{
+  // limit to STAR TPC/BEMC/ToF acceptance (default |eta| < 1)
+  double eta = ev.eta[i];
+  if (fabs(eta) < cuts.maxEtaH)
+    return true;
+  else
+    return false;
+}
+
+//
+//  The standard STAR cuts; always cut set 0
+//
+inline cutSet_t defaultCuts()
+{
+  cutSet_t cuts;
+  cuts.maxEtaE = 0.7;
+  cuts.maxEtaH = 1;
+  cuts.ptMinH = 0.2;
+  cuts.ptMinAssoc = 0.5;
+  return cuts;
+}
+
+//
+//  Cut sets from a string "etaE,etaH,ptMinH,ptMinAssoc/..." (no
+//  blanks, so it fits a Pythia word setting). The default set
+//  always comes first; the ones in the string are added to it.
+//  Returns false on a malformed string.
+//
+inline bool parseCutSets(const std::string &spec, std::vector<cutSet_t> &cutSets)
+{
+  cutSets.assign(1, defaultCuts());
+  if (spec.empty() || spec == "void") return true;
+  size_t begin = 0;
+  while (begin <= spec.size()) {
+    size_t end = spec.find('/', begin);
+    if (end == std::string::npos) end = spec.size();
+    std::string one = spec.substr(begin, end-begin);
+    cutSet_t cuts;
+    char extra;
+    if (sscanf(one.c_str(), "%lf,%lf,%lf,%lf%c", &cuts.maxEtaE, &cuts.maxEtaH,
+	       &cuts.ptMinH, &cuts.ptMinAssoc, &extra) != 4) return false;
+    cutSets.push_back(cuts);
+    begin = end+1;
+  }
+  return true;
+}
+
+inline double deltaPhi(double phi1, double phi2)
+{
+  // move to range [0, 2pi]                                                           
+  //if (phi1<0) phi1 += 2*M_PI;
+  //if (phi2<0) phi2 += 2*M_PI;
+
+  // correct difference                                                               
+  double delta = phi2-phi1;
+  if (delta < -M_PI) delta += 2*M_PI;
+  if (delta > M_PI) delta -= 2*M_PI;
+
+  return delta;
+}
+
+inline double deltaEta(double e1, double e2)
+{
+  double delta = e2-e1;
+  return delta;
+}
+
+//
+//  Innermost loop of the template production. For one trigger
+//  phi and n associated hadrons (phi, pt) computes the wrapped
+//  delta-phi as in deltaPhi(), flags near (|dphi| < 1) and away
+//  (|dphi - pi| < 1) side hadrons with pt >= ptMin and a nonzero
+//  mask (the acceptance of a cut set; 0 takes all), and counts
+//  and sums their pT. With AVX2 (compile with -mavx2) four pairs
+//  are done per instruction, the rest with the scalar loop.
+//
+inline void deltaPhiKernel(double phi1, const double* phi, const double* pt, const unsigned char* mask,
+			   int n, double ptMin, double* dphi, unsigned char* near, unsigned char* away,
+			   pairSums_t &sums)
+{
+  sums.nnear = sums.naway = 0;
+  sums.ptNear = sums.ptAway = 0;
+  int i = 0;
+
+#ifdef __AVX2__
+  const __m256d vphi1  = _mm256_set1_pd(phi1);
+  const __m256d vpi    = _mm256_set1_pd(M_PI);
+  const __m256d vmpi   = _mm256_set1_pd(-M_PI);
+  const __m256d v2pi   = _mm256_set1_pd(2*M_PI);
+  const __m256d vone   = _mm256_set1_pd(1.);
+  const __m256d vptMin = _mm256_set1_pd(ptMin);
+  const __m256d vabs   = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+  __m256d vptNear = _mm256_setzero_pd();
+  __m256d vptAway = _mm256_setzero_pd();
+  for (; i+4 <= n; i += 4) {
+    __m256d vpt = _mm256_loadu_pd(pt+i);
+    __m256d d = _mm256_sub_pd(_mm256_loadu_pd(phi+i), vphi1);
+    d = _mm256_add_pd(d, _mm256_and_pd(_mm256_cmp_pd(d, vmpi, _CMP_LT_OQ), v2pi));
+    d = _mm256_sub_pd(d, _mm256_and_pd(_mm256_cmp_pd(d, vpi, _CMP_GT_OQ), v2pi));
+    _mm256_storeu_pd(dphi+i, d);
+
+    __m256d ptOk  = _mm256_cmp_pd(vpt, vptMin, _CMP_GE_OQ);
+    if (mask) {
+      int bytes;
+      memcpy(&bytes, mask+i, 4);
+      __m256i m = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes));
+      ptOk = _mm256_and_pd(ptOk, _mm256_castsi256_pd(_mm256_cmpgt_epi64(m, _mm256_setzero_si256())));
+    }
+    __m256d mNear = _mm256_and_pd(ptOk, _mm256_cmp_pd(_mm256_and_pd(d, vabs), vone, _CMP_LT_OQ));
+    __m256d mAway = _mm256_and_pd(ptOk, _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(d, vpi), vabs), vone, _CMP_LT_OQ));
+    vptNear = _mm256_add_pd(vptNear, _mm256_and_pd(mNear, vpt));
+    vptAway = _mm256_add_pd(vptAway, _mm256_and_pd(mAway, vpt));
+
+    int bitsNear = _mm256_movemask_pd(mNear);
+    int bitsAway = _mm256_movemask_pd(mAway);
+    for (int k = 0; k < 4; k++) {
+      near[i+k] = (bitsNear >> k) & 1;
+      away[i+k] = (bitsAway >> k) & 1;
+    }
+    sums.nnear += __builtin_popcount(bitsNear);
+    sums.naway += __builtin_popcount(bitsAway);
+  }
+  double buf[4];
+  _mm256_storeu_pd(buf, vptNear);
+  sums.ptNear = buf[0] + buf[1] + buf[2] + buf[3];
+  _mm256_storeu_pd(buf, vptAway);
+  sums.ptAway = buf[0] + buf[1] + buf[2] + buf[3];
+#endif
+
+  for (; i < n; i++) {
+    double d = phi[i] - phi1;
+    if (d < -M_PI) d += 2*M_PI;
+    if (d > M_PI) d -= 2*M_PI;
+    dphi[i] = d;
+    bool ptOk = pt[i] >= ptMin && (!mask || mask[i]);
+    near[i] = ptOk && fabs(d) < 1;
+    away[i] = ptOk && fabs(d-M_PI) < 1;
+    if (near[i]) {
+      sums.nnear++;
+      sums.ptNear += pt[i];
+    }
+    if (away[i]) {
+      sums.naway++;
+      sums.ptAway += pt[i];
+    }
+  }
+}
+
+//
+//  Book one family of template histograms. Names are
+//  histos2D<name><i> and histo3D<name><i>; the downstream macros
+//  rely on them.
+//
+inline void bookHistogramFamily(std::vector<TH2D*> &histos2D, std::vector<TH3F*> &histos3D, const char* histname)
+{
+  char text[160];
+  sprintf(text,"histos2D%s%d",histname,0);
+  histos2D.push_back(new TH2D(text,"NPE - h", 150,0.,15.,200, -0.5*M_PI, 1.5*M_PI));
+  sprintf(text,"histos2D%s%d",histname,1);
+  histos2D.push_back(new TH2D(text,"NPE pt vs y", 150, 0., 15., 60, -3, 3));
+  sprintf(text,"histos2D%s%d",histname,2);
+  histos2D.push_back(new TH2D(text,"near-side Nch", 150, 0, 15, 50, 0., 50.));
+  sprintf(text,"histos2D%s%d",histname,3);
+  histos2D.push_back(new TH2D(text,"away-side Nch", 150, 0, 15, 50, 0., 50.));
+  sprintf(text,"histos2D%s%d",histname,4);
+  histos2D.push_back(new TH2D(text,"near-side pt", 150, 0, 15, 150, 0., 15.));
+  sprintf(text,"histos2D%s%d",histname,5);
+  histos2D.push_back(new TH2D(text,"away-side pt", 150, 0, 15, 150, 0., 15.));
+  sprintf(text,"histos2D%s%d",histname,6);
+  histos2D.push_back(new TH2D(text,"near-side m0", 150, 0, 15, 100, 0., 1.));
+  sprintf(text,"histos2D%s%d",histname,7);
+  histos2D.push_back(new TH2D(text,"away-side m0", 150, 0, 15, 100, 0., 1.));
+  sprintf(text,"histos2D%s%d",histname,8);
+  histos2D.push_back(new TH2D(text,"pt balance", 150, 0, 15, 100, -10, 10.));
+  sprintf(text,"histos2D%s%d",histname,9);
+  histos2D.push_back(new TH2D(text,"B daughter pt", 150, 0, 15, 150, 0, 15.));
+
+  //
+  //  The 3D templates dominate the memory. They are single
+  //  precision and the delta-phi axis only spans the range
+  //  deltaPhi() returns, [-pi, pi], in bins of ~0.1.
+  //
+  sprintf(text,"histo3D%s%d",histname,0);
+  histos3D.push_back(new TH3F(text,"NPE - h", 150,0.,15., 150,0,15, 64, -M_PI, M_PI));
+  sprintf(text,"histo3D%s%d",histname,1);
+  histos3D.push_back(new TH3F(text,"NPE - B-->h", 150,0.,15.,150,0,15, 64, -M_PI, M_PI));
+}
+
+//
+//  Book the families of all cut sets. Set 0 keeps the plain
+//  names, set k > 0 is booked as <name>_cut<k>_.
+//
+inline void bookHistograms(std::vector<TH2D*> &histos2D, std::vector<TH3F*> &histos3D, const char* histname,
+			   int nCutSets = 1)
+{
+  bookHistogramFamily(histos2D, histos3D, histname);
+  for (int k = 1; k < nCutSets; k++) {
+    char family[128];
+    sprintf(family, "%s_cut%d_", histname, k);
+    bookHistogramFamily(histos2D, histos3D, family);
+  }
+}
+
+//
+//  Weighted fills need the sum of squared weights for the errors.
+//  Only call this on empty histograms.
+//
+inline void enableWeights(std::vector<TH2D*> &histos2D, std::vector<TH3F*> &histos3D)
+{
+  for (unsigned int k = 0; k < histos2D.size(); k++) histos2D[k]->Sumw2();
+  for (unsigned int k = 0; k < histos3D.size(); k++) histos3D[k]->Sumw2();
+}
+
+//
+//  Analysis of one event snapshot for all cut sets. Returns the
+//  number of electrons from c/b hadron decays in the acceptance
+//  of cut set 0. If perf is given, the selection, pair and fill
+//  phases are timed and the triggers and pairs counted.
+//
+inline int analyzeEvent(const eventSnapshot_t &ev, std::vector<TH2D*> &histos2D, std::vector<TH3F*> &histos3D,
+			const std::vector<cutSet_t> &cutSets, double weight,
+			perfCounters_t *perf = 0)
+{
+  double tPhase = perf ? perfClock() : 0;
+
+  if (ev.motherError) {
+    std::cout << "Error: electron has more than one mother. Stop." << std::endl;
+    //abort();
+    return 0;
+  }
+
+  //
+  //  The loosest cuts of all sets select the particles; each set
+  //  then masks out what it does not accept.
+  //
+  cutSet_t loose = cutSets[0];
+  for (unsigned int s = 1; s < cutSets.size(); s++) {
+    loose.maxEtaE = std::max(loose.maxEtaE, cutSets[s].maxEtaE);
+    loose.maxEtaH = std::max(loose.maxEtaH, cutSets[s].maxEtaH);
+    loose.ptMinH = std::min(loose.ptMinH, cutSets[s].ptMinH);
+  }
+
+  //
+  //  Single pass over the snapshot: collect the electron
+  //  candidates (triggers) and the associated hadron candidates.
+  //  The hadrons are required to be stable, i.e. not decayed,
+  //  and we impose the pt cut on hadrons as in data. All triggers
+  //  below share these two lists.
+  //
+  std::vector<int> triggers;
+  std::vector<int> candidates;
+  for (int i = 0; i < ev.size(); i++) {
+    if (abs(ev.id[i]) == 11) triggers.push_back(i);
+    if (ev.status[i] > 0 && ev.charge[i] != 0 && ev.pt[i] > loose.ptMinH && isInAcceptanceH(i, ev, loose))
+      candidates.push_back(i);
+  }
+  if (perf) perf->seconds[perfCounters_t::kSelect] += perfClock() - tPhase;
+
+  int nelectrons = 0;
+  int ie = 0;
+  std::vector<int> hadrons;
+  std::vector<int> B_hadrons;
+  hadrons.reserve(candidates.size());
+
+  //
+  //  Contiguous per-trigger arrays for the delta-phi kernel
+  //
+  std::vector<double> assocPhi(candidates.size()+1);
+  std::vector<double> assocPt(candidates.size()+1);
+  std::vector<double> dphi(candidates.size()+1);
+  std::vector<unsigned char> near(candidates.size()+1);
+  std::vector<unsigned char> away(candidates.size()+1);
+  std::vector<unsigned char> accepted(candidates.size()+1);
+  pairSums_t sums;
+
+  for (unsigned int it = 0; it < triggers.size(); it++) {
+    ie = triggers[it];
+
+    //
+    //  Check if mother is a c/b hadron
+    //
+    int flavor = hfFlavor(ev.motherId[ie]);
+    if (flavor != 4 && flavor != 5) continue; // c (b) hadrons start with 4(5)  
+
+    //
+    //  Acceptance filter
+    //    
+    if (!(isInAcceptanceE(ie, ev, loose))) continue;
+    if (perf) tPhase = perfClock();
+    
+    //
+    // At this point we have the electron and its c/b mother, the
+    // electron detectable in STAR. Take the associated hadrons from
+    // the candidate list, skipping those with the trigger's id.
+    // B_hadrons holds the positions (in hadrons) of those that
+    // come from the same B as the electron.
+    //
+    int iB = ev.hfAncestorFlavor[ie] == 5 ? ev.hfAncestor[ie] : -1;
+    hadrons.clear();
+    B_hadrons.clear();
+    for (unsigned int k = 0; k < candidates.size(); k++) {
+      int hid = candidates[k];
+      if (ev.id[hid] == ev.id[ie]) continue;
+      if (iB >= 0 && ev.hfAncestor[hid] == iB) B_hadrons.push_back(hadrons.size());
+      assocPhi[hadrons.size()] = ev.phi[hid];
+      assocPt[hadrons.size()] = ev.pt[hid];
+      hadrons.push_back(hid);
+    }
+      
+    Double_t npept = ev.pt[ie];
+    double phi1;
+    int hid;
+    phi1 = ev.phi[ie];
+      
+    if (perf) perf->pairs += hadrons.size();
+
+    for (unsigned int s = 0; s < cutSets.size(); s++) {
+      const cutSet_t &cuts = cutSets[s];
+      if (!(isInAcceptanceE(ie, ev, cuts))) continue;
+      if (s == 0) nelectrons++;
+      TH2D **h2 = &histos2D[s*kHistos2DPerSet];
+      TH3F **h3 = &histos3D[s*kHistos3DPerSet];
+
+      //
+      //  Delta-phi, near/away classification and the near/away
+      //  counts and pT sums of the set's accepted hadrons above
+      //  its ptMinAssoc in one go
+      //
+      for (unsigned int i=0; i<hadrons.size(); i++) {
+	hid = hadrons[i];
+	accepted[i] = assocPt[i] > cuts.ptMinH && isInAcceptanceH(hid, ev, cuts);
+      }
+      deltaPhiKernel(phi1, &assocPhi[0], &assocPt[0], &accepted[0], hadrons.size(), cuts.ptMinAssoc,
+		     &dphi[0], &near[0], &away[0], sums);
+      if (perf) {
+	double t = perfClock();
+	perf->seconds[perfCounters_t::kPairs] += t - tPhase;
+	tPhase = t;
+      }
+
+      //
+      //  Fill histograms                                                       
+      //
+      
+      //histos[2]->Fill(event[i_B].pT(), 1.);                                       
+      h2[1]->Fill(ev.pt[ie], ev.y[ie], weight);
+
+      for (unsigned int i=0; i<B_hadrons.size(); i++) {
+	int k = B_hadrons[i];
+	if (!accepted[k]) continue;
+	h2[9]->Fill(npept, assocPt[k], weight);
+	h3[1]->Fill(npept, assocPt[k], dphi[k], weight);
+      }
+
+      for (unsigned int i=0; i<hadrons.size(); i++) {
+	if (!accepted[i]) continue;
+	hid = hadrons[i];
+	h3[0]->Fill(npept, assocPt[i], dphi[i], weight);
+	if(assocPt[i]<cuts.ptMinAssoc) continue;
+	h2[0]->Fill(npept, dphi[i], weight);
+	if (near[i]) { //near side
+	  h2[4]->Fill(npept, assocPt[i], weight);
+	  h2[6]->Fill(npept, ev.m0[hid], weight);
+	}
+	if (away[i]) { //away side
+	  h2[5]->Fill(npept, assocPt[i], weight);
+	  h2[7]->Fill(npept, ev.m0[hid], weight);
+	}
+      }
+      h2[2]->Fill(npept, sums.nnear, weight);
+      h2[3]->Fill(npept, sums.naway, weight);
+      h2[8]->Fill(npept, npept + sums.ptNear - sums.ptAway, weight);
+      if (perf) {
+	double t = perfClock();
+	perf->seconds[perfCounters_t::kFill] += t - tPhase;
+	tPhase = t;
+      }
+    }
+  }
+
+  if (perf) perf->triggers += nelectrons;
+  return nelectrons;
+}
+
+#endif
@@ -0,0 +1,354 @@
+//==============================================================================
+//  NPEHBench.cpp
+//
+//  Timing of the pieces of the NPE-h analysis (NPEHAnalysis.h) in
+//  isolation, without Pythia: delta-phi, the acceptance filters,
+//  the flavor classification, the hadron selection, the histogram
+//  fills and the whole analyzeEvent(). The events come from an
+//  event record written with NPE:saveEvents or, without one, from
+//  a synthetic corpus that is the same on every run.
+//
+//  Each benchmark is run --repeat times over all events and the
+//  fastest pass is reported, in ns per pair, particle or event.
+//
+//  Usage: NPEHBench [--repeat R] [--events N] [record.npeev]
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <iostream>
+#include "TH2D.h"
+#include "TH3F.h"
+#include "NPEHAnalysis.h"
+using namespace std;
+
+//
+//  The events and the pairs built from them once, so that the
+//  benchmarks of the single steps do not time the preparation
+//
+struct benchCorpus_t {
+  vector<eventSnapshot_t> events;
+  long nParticles;
+  long nTriggers;           // c/b electrons in the acceptance
+  long nPairs;              // trigger - hadron candidate pairs
+  vector<double> triggerPhi;
+  vector<int>    pairBegin; // per trigger, into pairPhi/pairPt
+  vector<double> pairPhi;
+  vector<double> pairPt;
+  vector<double> triggerPt;
+};
+
+//
+//  Forward declarations
+//
+bool loadRecords(const char*, long, benchCorpus_t&);
+void makeSyntheticEvents(long, benchCorpus_t&);
+void preparePairs(benchCorpus_t&);
+void report(const char*, double, long, const char*);
+
+// defeats dead-code elimination of the timed loops
+volatile double benchSink;
+
+// small deterministic generator (64-bit LCG), same corpus everywhere
+struct benchRandom_t {
+  benchRandom_t(unsigned long long seed) : state(seed) {}
+  double flat() {
+    state = state*6364136223846793005ULL + 1442695040888963407ULL;
+    return (state >> 11)*(1./9007199254740992.);
+  }
+  unsigned long long state;
+};
+
+int main(int argc, char* argv[]) {
+
+  int nRepeat = 5;
+  long nEvents = 20000;
+  const char* recordFile = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--repeat") && i+1 < argc) nRepeat = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--events") && i+1 < argc) nEvents = atol(argv[++i]);
+    else if (argv[i][0] != '-' && !recordFile) recordFile = argv[i];
+    else nRepeat = 0;
+  }
+  if (nRepeat < 1 || nEvents < 1) {
+    cout << "Usage: " << argv[0] << " [--repeat R] [--events N] [record.npeev]" << endl;
+    return 2;
+  }
+
+  benchCorpus_t corpus;
+  if (recordFile) {
+    if (!loadRecords(recordFile, nEvents, corpus)) {
+      cout << "Error: cannot read event record '" << recordFile << "'" << endl;
+      return 1;
+    }
+  }
+  else makeSyntheticEvents(nEvents, corpus);
+  preparePairs(corpus);
+
+  long nEv = corpus.events.size();
+  cout << "Corpus: " << (recordFile ? recordFile : "synthetic") << ", " << nEv << " events, "
+       << corpus.nParticles << " particles, " << corpus.nTriggers << " triggers, "
+       << corpus.nPairs << " pairs" << endl;
+#ifdef __AVX2__
+  cout << "deltaPhiKernel: AVX2" << endl;
+#else
+  cout << "deltaPhiKernel: scalar" << endl;
+#endif
+  if (nEv == 0 || corpus.nPairs == 0) {
+    cout << "Error: nothing to time" << endl;
+    return 1;
+  }
+
+  const cutSet_t cuts = defaultCuts();
+  vector<cutSet_t> cutSets(1, cuts);
+  vector<TH2D*> histos2D;
+  vector<TH3F*> histos3D;
+  bookHistograms(histos2D, histos3D, "Bench");
+  for (unsigned int k = 0; k < histos2D.size(); k++) histos2D[k]->SetDirectory(0);
+  for (unsigned int k = 0; k < histos3D.size(); k++) histos3D[k]->SetDirectory(0);
+
+  vector<double> dphi(corpus.pairPhi.size()+1);
+  vector<unsigned char> near(corpus.pairPhi.size()+1);
+  vector<unsigned char> away(corpus.pairPhi.size()+1);
+  vector<int> candidates;
+  double best, t0, t;
+  double sum;
+
+  //
+  //  deltaPhi() pair by pair
+  //
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    sum = 0;
+    t0 = perfClock();
+    for (unsigned int it = 0; it < corpus.triggerPhi.size(); it++)
+      for (int k = corpus.pairBegin[it]; k < corpus.pairBegin[it+1]; k++)
+	sum += deltaPhi(corpus.triggerPhi[it], corpus.pairPhi[k]);
+    t = perfClock() - t0;
+    if (t < best) best = t;
+    benchSink = sum;
+  }
+  report("deltaPhi", best, corpus.nPairs, "pair");
+
+  //
+  //  deltaPhiKernel() per trigger
+  //
+  best = 1e30;
+  pairSums_t sums;
+  for (int r = 0; r < nRepeat; r++) {
+    sum = 0;
+    t0 = perfClock();
+    for (unsigned int it = 0; it < corpus.triggerPhi.size(); it++) {
+      int k = corpus.pairBegin[it];
+      deltaPhiKernel(corpus.triggerPhi[it], &corpus.pairPhi[k], &corpus.pairPt[k], 0,
+		     corpus.pairBegin[it+1] - k, cuts.ptMinAssoc, &dphi[k], &near[k], &away[k], sums);
+      sum += sums.ptNear + sums.nnear;
+    }
+    t = perfClock() - t0;
+    if (t < best) best = t;
+    benchSink = sum;
+  }
+  report("deltaPhiKernel", best, corpus.nPairs, "pair");
+
+  //
+  //  Acceptance filters on every particle
+  //
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    long n = 0;
+    t0 = perfClock();
+    for (long iev = 0; iev < nEv; iev++) {
+      const eventSnapshot_t &ev = corpus.events[iev];
+      for (int i = 0; i < ev.size(); i++) n += isInAcceptanceE(i, ev, cuts) + isInAcceptanceH(i, ev, cuts);
+    }
+    t = perfClock() - t0;
+    if (t < best) best = t;
+    benchSink = n;
+  }
+  report("isInAcceptanceE+H", best, corpus.nParticles, "particle");
+
+  //
+  //  Flavor classification (pow/log10) of every particle id
+  //
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    long n = 0;
+    t0 = perfClock();
+    for (long iev = 0; iev < nEv; iev++) {
+      const eventSnapshot_t &ev = corpus.events[iev];
+      for (int i = 0; i < ev.size(); i++) n += hfFlavor(ev.id[i]);
+    }
+    t = perfClock() - t0;
+    if (t < best) best = t;
+    benchSink = n;
+  }
+  report("hfFlavor", best, corpus.nParticles, "particle");
+
+  //
+  //  Hadron selection as in analyzeEvent()
+  //
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    long n = 0;
+    t0 = perfClock();
+    for (long iev = 0; iev < nEv; iev++) {
+      const eventSnapshot_t &ev = corpus.events[iev];
+      candidates.clear();
+      for (int i = 0; i < ev.size(); i++)
+	if (ev.status[i] > 0 && ev.charge[i] != 0 && ev.pt[i] > cuts.ptMinH && isInAcceptanceH(i, ev, cuts))
+	  candidates.push_back(i);
+      n += candidates.size();
+    }
+    t = perfClock() - t0;
+    if (t < best) best = t;
+    benchSink = n;
+  }
+  report("hadron selection", best, nEv, "event");
+
+  //
+  //  Histogram fills, one TH2D and one TH3F fill per pair
+  //
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    t0 = perfClock();
+    for (unsigned int it = 0; it < corpus.triggerPhi.size(); it++)
+      for (int k = corpus.pairBegin[it]; k < corpus.pairBegin[it+1]; k++)
+	histos2D[0]->Fill(corpus.triggerPt[it], corpus.pairPhi[k] - corpus.triggerPhi[it], 1.);
+    t = perfClock() - t0;
+    if (t < best) best = t;
+  }
+  report("TH2D::Fill", best, corpus.nPairs, "pair");
+
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    t0 = perfClock();
+    for (unsigned int it = 0; it < corpus.triggerPhi.size(); it++)
+      for (int k = corpus.pairBegin[it]; k < corpus.pairBegin[it+1]; k++)
+	histos3D[0]->Fill(corpus.triggerPt[it], corpus.pairPt[k], corpus.pairPhi[k] - corpus.triggerPhi[it], 1.);
+    t = perfClock() - t0;
+    if (t < best) best = t;
+  }
+  report("TH3F::Fill", best, corpus.nPairs, "pair");
+
+  //
+  //  The whole analysis
+  //
+  best = 1e30;
+  for (int r = 0; r < nRepeat; r++) {
+    long n = 0;
+    t0 = perfClock();
+    for (long iev = 0; iev < nEv; iev++)
+      n += analyzeEvent(corpus.events[iev], histos2D, histos3D, cutSets, 1.);
+    t = perfClock() - t0;
+    if (t < best) best = t;
+    benchSink = n;
+  }
+  report("analyzeEvent", best, nEv, "event");
+  report("analyzeEvent", best, corpus.nPairs, "pair");
+
+  return 0;
+}
+
+//
+//  One result line: total time of the fastest pass and the time
+//  per unit
+//
+void report(const char* name, double seconds, long n, const char* unit)
+{
+  char text[256];
+  sprintf(text, "%-20s %10.3f ms  %10.2f ns/%s", name, 1e3*seconds, 1e9*seconds/n, unit);
+  cout << text << endl;
+}
+
+//
+//  Up to nMax events of an event record
+//
+bool loadRecords(const char* name, long nMax, benchCorpus_t &corpus)
+{
+  npeRecordReader_t reader;
+  if (!reader.open(name)) return false;
+  const npeRecordParticle_t *particles;
+  int n;
+  double weight;
+  while (static_cast<long>(corpus.events.size()) < nMax && (particles = reader.next(n, weight))) {
+    corpus.events.push_back(eventSnapshot_t());
+    recordToSnapshot(particles, n, corpus.events.back());
+  }
+  return true;
+}
+
+//
+//  Synthetic events: charged hadrons with an exponential pT
+//  spectrum, flat in eta (|eta| < 2) and phi, and one or two
+//  electrons, most of them from D or B mesons. Roughly the
+//  multiplicity of a minimum-bias pp event at 200 GeV.
+//
+void makeSyntheticEvents(long nEvents, benchCorpus_t &corpus)
+{
+  static const int hadronIds[4] = {211, -211, 321, 2212};
+  static const int motherIds[5] = {421, 411, 511, 521, 22};
+  benchRandom_t random(20081209);
+  corpus.events.resize(nEvents);
+  for (long iev = 0; iev < nEvents; iev++) {
+    eventSnapshot_t &ev = corpus.events[iev];
+    int nHadrons = 10 + static_cast<int>(40*random.flat());
+    int nElectrons = 1 + (random.flat() < 0.2);
+    for (int i = 0; i < nHadrons + nElectrons; i++) {
+      bool electron = i >= nHadrons;
+      int id = electron ? (random.flat() < 0.5 ? 11 : -11) : hadronIds[static_cast<int>(4*random.flat())];
+      int motherId = electron ? motherIds[static_cast<int>(5*random.flat())] : 0;
+      double pt = electron ? 1 + 9*random.flat() : -0.5*log(1 - random.flat());
+      double eta = 4*random.flat() - 2;
+      ev.index.push_back(i);
+      ev.id.push_back(id);
+      ev.status.push_back(1);
+      ev.charge.push_back(abs(id) == 11 ? (id > 0 ? -1 : 1) : (id > 0 ? 1 : -1));  // e- is id 11
+      ev.pt.push_back(pt);
+      ev.eta.push_back(eta);
+      ev.phi.push_back(M_PI*(2*random.flat() - 1));
+      ev.y.push_back(eta);
+      ev.m0.push_back(electron ? 0.000511 : 0.1396);
+      ev.motherId.push_back(motherId);
+      int flavor = hfFlavor(motherId);
+      ev.hfAncestor.push_back(flavor == 4 || flavor == 5 ? nHadrons + nElectrons : -1);
+      ev.hfAncestorFlavor.push_back(flavor == 4 || flavor == 5 ? flavor : 0);
+    }
+  }
+}
+
+//
+//  Trigger - candidate pairs with the default cuts, laid out as
+//  analyzeEvent() builds them
+//
+void preparePairs(benchCorpus_t &corpus)
+{
+  const cutSet_t cuts = defaultCuts();
+  corpus.nParticles = corpus.nTriggers = 0;
+  corpus.pairBegin.push_back(0);
+  for (unsigned int iev = 0; iev < corpus.events.size(); iev++) {
+    const eventSnapshot_t &ev = corpus.events[iev];
+    corpus.nParticles += ev.size();
+    for (int ie = 0; ie < ev.size(); ie++) {
+      if (abs(ev.id[ie]) != 11) continue;
+      int flavor = hfFlavor(ev.motherId[ie]);
+      if ((flavor != 4 && flavor != 5) || !isInAcceptanceE(ie, ev, cuts)) continue;
+      corpus.nTriggers++;
+      corpus.triggerPhi.push_back(ev.phi[ie]);
+      corpus.triggerPt.push_back(ev.pt[ie]);
+      for (int i = 0; i < ev.size(); i++) {
+	if (ev.id[i] == ev.id[ie]) continue;
+	if (ev.status[i] > 0 && ev.charge[i] != 0 && ev.pt[i] > cuts.ptMinH && isInAcceptanceH(i, ev, cuts)) {
+	  corpus.pairPhi.push_back(ev.phi[i]);
+	  corpus.pairPt.push_back(ev.pt[i]);
+	}
+      }
+      corpus.pairBegin.push_back(corpus.pairPhi.size());
+    }
+  }
+  corpus.nPairs = corpus.pairPhi.size();
+}
@@ -0,0 +1,406 @@
+//==============================================================================
+//  NPEHBootstrap.cpp
+//
+//  Statistical uncertainty of the B and C templates by bootstrap
+//  over the per-seed outputs of a campaign (NpeBHcorr_<seed>.root,
+//  NpeCHcorr_<seed>.root). A replica draws as many files as there
+//  are, with replacement, and merges them; the spread of the
+//  replicas is the template uncertainty of every bin and, fitting
+//  the data with each replica (NPEHTemplateFit.h), of the B
+//  fraction.
+//
+//  Each file is read and projected onto the electron pT bins once.
+//  A replica is the nominal sum plus (count-1) times the files
+//  drawn other than once, so it costs a fraction of a merge and
+//  no file access. The replicas are run by worker threads, each
+//  with its own random sequence, so the result does not depend on
+//  the number of threads.
+//
+//  Usage: NPEHBootstrap BHist CHist --B B_1.root ... --C C_1.root ...
+//                       [--data data.root dataHist] [--replicas R]
+//                       [--threads N] [--seed S] [--pt e0,e1,...]
+//                       [--output boot.root]
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <iostream>
+#include "TFile.h"
+#include "TH1D.h"
+#include "TH2D.h"
+#include "NPEHMerge.h"
+#include "NPEHTemplateFit.h"
+using namespace std;
+
+//
+//  The per-file projections of one template and their sum
+//
+struct bootstrapSample_t {
+  string histname;
+  vector<string> files;
+  vector<templateBins_t> parts;
+  templateBins_t total;
+};
+
+//
+//  64-bit LCG, one sequence per replica and sample (flavor 0 for
+//  B, 1 for C). The start is a splitmix64 hash of the seed mixed
+//  with (replica, flavor), so the streams of different --seed
+//  values are unrelated instead of shifted copies of each other.
+//
+inline unsigned long long splitmix64(unsigned long long x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27))*0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+struct bootstrapRandom_t {
+  bootstrapRandom_t(unsigned long long seed, unsigned long long replica, int flavor) :
+    state(splitmix64(splitmix64(seed) ^ (replica << 1 | flavor))) {}
+  unsigned int index(unsigned int n) {
+    state = state*6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<unsigned int>(((state >> 11)*(1./9007199254740992.))*n);
+  }
+  unsigned long long state;
+};
+
+struct bootstrapJob_t {
+  const bootstrapSample_t *sampleB, *sampleC;
+  const templateBins_t *data;        // 0: no fits
+  unsigned long long seed;
+  int nReplicas;
+  int next;                          // protected by mutex
+  pthread_mutex_t mutex;
+  vector<double> contentB, contentC; // per replica: nPt*nPhi bins
+  vector<double> fractionB;          // per replica: nPt fitted fractions
+  vector<int> fitStatus;
+};
+
+//
+//  Reads histname from every file and projects it onto the pT
+//  bins. Unusable files are reported and left out.
+//
+bool loadSample(bootstrapSample_t &sample, const vector<double> &ptEdges, TH2 *reference)
+{
+  vector<string> files;
+  for (unsigned int k = 0; k < sample.files.size(); k++) {
+    string why;
+    if (!isMergeableFile(sample.files[k], why)) {
+      cout << "Skipping '" << sample.files[k] << "': " << why << endl;
+      continue;
+    }
+    TH2 *h = readTemplate(sample.files[k].c_str(), sample.histname.c_str());
+    if (!h) continue;
+    if (!sameBinning(h, reference)) {
+      cout << "Skipping '" << sample.files[k] << "': binning differs from '" << sample.files[0] << "'" << endl;
+      delete h;
+      continue;
+    }
+    sample.parts.push_back(templateBins_t());
+    projectTemplate(h, ptEdges, sample.parts.back());
+    files.push_back(sample.files[k]);
+    delete h;
+  }
+  sample.files = files;
+  if (sample.parts.size() < 2) {
+    cout << "Error: " << sample.parts.size() << " usable files for '" << sample.histname
+	 << "', the bootstrap needs at least 2" << endl;
+    return false;
+  }
+  sample.total = sample.parts[0];
+  for (unsigned int k = 1; k < sample.parts.size(); k++)
+    for (unsigned int i = 0; i < sample.total.content.size(); i++) {
+      sample.total.content[i] += sample.parts[k].content[i];
+      sample.total.error2[i] += sample.parts[k].error2[i];
+    }
+  return true;
+}
+
+//
+//  One replica of sample: the nominal sum corrected by the files
+//  not drawn exactly once
+//
+void drawReplica(const bootstrapSample_t &sample, bootstrapRandom_t &random,
+		 vector<int> &counts, templateBins_t &replica)
+{
+  unsigned int nFiles = sample.parts.size();
+  counts.assign(nFiles, 0);
+  for (unsigned int k = 0; k < nFiles; k++) counts[random.index(nFiles)]++;
+  replica = sample.total;
+  for (unsigned int k = 0; k < nFiles; k++) {
+    if (counts[k] == 1) continue;
+    double w = counts[k] - 1;
+    const templateBins_t &part = sample.parts[k];
+    for (unsigned int i = 0; i < replica.content.size(); i++) {
+      replica.content[i] += w*part.content[i];
+      replica.error2[i] += w*part.error2[i];
+    }
+  }
+}
+
+void* bootstrapThread(void* arg)
+{
+  bootstrapJob_t &job = *static_cast<bootstrapJob_t*>(arg);
+  const int nBins = job.sampleB->total.content.size();
+  const int nPt = job.sampleB->total.nPt;
+  vector<int> counts;
+  templateBins_t replicaB, replicaC;
+  for (;;) {
+    pthread_mutex_lock(&job.mutex);
+    int ir = job.next++;
+    pthread_mutex_unlock(&job.mutex);
+    if (ir >= job.nReplicas) break;
+
+    bootstrapRandom_t randomB(job.seed, ir, 0), randomC(job.seed, ir, 1);
+    drawReplica(*job.sampleB, randomB, counts, replicaB);
+    drawReplica(*job.sampleC, randomC, counts, replicaC);
+    copy(replicaB.content.begin(), replicaB.content.end(), job.contentB.begin() + ir*nBins);
+    copy(replicaC.content.begin(), replicaC.content.end(), job.contentC.begin() + ir*nBins);
+    if (!job.data) continue;
+
+    for (int k = 0; k < nPt; k++) {
+      templateFitTask_t task;
+      task.data = job.data->contentOf(k);
+      task.b = replicaB.contentOf(k);
+      task.b2 = replicaB.error2Of(k);
+      task.c = replicaC.contentOf(k);
+      task.c2 = replicaC.error2Of(k);
+      task.n = job.data->nPhi;
+      fitTemplates(task);
+      job.fractionB[ir*nPt + k] = task.result.fB;
+      job.fitStatus[ir*nPt + k] = task.result.status;
+    }
+  }
+  return 0;
+}
+
+//
+//  Bootstrap RMS of each bin over the replicas, and its ratio to
+//  the error of the nominal sum, averaged over the delta-phi bins
+//  of each pT bin
+//
+void binSpread(const vector<double> &contents, int nReplicas, const templateBins_t &total,
+	       vector<double> &rms, vector<double> &ratio)
+{
+  const int nBins = total.content.size();
+  rms.assign(nBins, 0.);
+  ratio.assign(total.nPt, 0.);
+  for (int i = 0; i < nBins; i++) {
+    double sum = 0, sum2 = 0;
+    for (int ir = 0; ir < nReplicas; ir++) {
+      double x = contents[ir*nBins + i];
+      sum += x;
+      sum2 += x*x;
+    }
+    double mean = sum/nReplicas;
+    double var = (sum2 - nReplicas*mean*mean)/(nReplicas - 1);
+    rms[i] = var > 0 ? sqrt(var) : 0;
+  }
+  for (int k = 0; k < total.nPt; k++) {
+    int n = 0;
+    for (int j = 0; j < total.nPhi; j++) {
+      int i = k*total.nPhi + j;
+      if (total.error2[i] <= 0) continue;
+      ratio[k] += rms[i]/sqrt(total.error2[i]);
+      n++;
+    }
+    if (n) ratio[k] /= n;
+  }
+}
+
+//
+//  Bootstrap RMS per bin as TH2D (x: pT bin index, y: delta-phi)
+//
+void writeSpread(const char* name, const vector<double> &rms, const templateBins_t &total, TH2 *reference)
+{
+  TAxis *yAxis = reference->GetYaxis();
+  TH2D *h = new TH2D(name, "bootstrap RMS;p_{T} bin;#Delta#phi", total.nPt, 0, total.nPt,
+		     total.nPhi, yAxis->GetXmin(), yAxis->GetXmax());
+  for (int k = 0; k < total.nPt; k++)
+    for (int j = 0; j < total.nPhi; j++) h->SetBinContent(k+1, j+1, rms[k*total.nPhi + j]);
+}
+
+int main(int argc, char* argv[]) {
+
+  bootstrapSample_t sampleB, sampleC;
+  vector<string> args;
+  vector<string> *fileList = 0;
+  const char* dataFile = 0;
+  const char* dataHist = 0;
+  const char* ptText = 0;
+  const char* output = 0;
+  int nReplicas = 200;
+  int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned long long seed = 20081209;
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--", 2)) fileList = 0;     // an option ends a file list
+    if (!strcmp(argv[i], "--B")) fileList = &sampleB.files;
+    else if (!strcmp(argv[i], "--C")) fileList = &sampleC.files;
+    else if (!strcmp(argv[i], "--data") && i+2 < argc) {
+      dataFile = argv[++i];
+      dataHist = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--replicas") && i+1 < argc) nReplicas = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--threads") && i+1 < argc) nThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--seed") && i+1 < argc) seed = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--pt") && i+1 < argc) ptText = argv[++i];
+    else if (!strcmp(argv[i], "--output") && i+1 < argc) output = argv[++i];
+    else if (fileList) fileList->push_back(argv[i]);
+    else args.push_back(argv[i]);
+  }
+  if (args.size() != 2 || sampleB.files.empty() || sampleC.files.empty() || nReplicas < 2 || nThreads < 1) {
+    cout << "Usage: " << argv[0] << " BHist CHist --B B_1.root ... --C C_1.root ..." << endl
+	 << "       [--data data.root dataHist] [--replicas R] [--threads N] [--seed S]"
+	 << " [--pt e0,e1,...] [--output boot.root]" << endl;
+    return 2;
+  }
+  sampleB.histname = args[0];
+  sampleC.histname = args[1];
+
+  //
+  //  The binning is taken from the first B file
+  //
+  TH2 *reference = readTemplate(sampleB.files[0].c_str(), sampleB.histname.c_str());
+  if (!reference) return 1;
+  vector<double> ptEdges;
+  if (ptText) {
+    if (!parsePtEdges(ptText, ptEdges)) {
+      cout << "Error: bad pT edges '" << ptText << "'" << endl;
+      return 2;
+    }
+  }
+  else {
+    TAxis *xAxis = reference->GetXaxis();
+    for (int ix = 1; ix <= xAxis->GetNbins(); ix++) ptEdges.push_back(xAxis->GetBinLowEdge(ix));
+    ptEdges.push_back(xAxis->GetBinUpEdge(xAxis->GetNbins()));
+  }
+
+  time_t start = time(0);
+  if (!loadSample(sampleB, ptEdges, reference) || !loadSample(sampleC, ptEdges, reference)) return 1;
+  templateBins_t data;
+  if (dataFile) {
+    TH2 *hData = readTemplate(dataFile, dataHist);
+    if (!hData) return 1;
+    if (!sameBinning(hData, reference)) {
+      cout << "Error: data and templates have different binnings" << endl;
+      return 1;
+    }
+    projectTemplate(hData, ptEdges, data);
+    delete hData;
+  }
+  cout << sampleB.files.size() << " B and " << sampleC.files.size() << " C files read in "
+       << time(0) - start << " s" << endl;
+
+  //
+  //  Replicas
+  //
+  const int nPt = ptEdges.size() - 1;
+  const int nBins = sampleB.total.content.size();
+  bootstrapJob_t job;
+  job.sampleB = &sampleB;
+  job.sampleC = &sampleC;
+  job.data = dataFile ? &data : 0;
+  job.seed = seed;
+  job.nReplicas = nReplicas;
+  job.next = 0;
+  job.contentB.resize(nReplicas*nBins);
+  job.contentC.resize(nReplicas*nBins);
+  job.fractionB.resize(nReplicas*nPt);
+  job.fitStatus.resize(nReplicas*nPt);
+  pthread_mutex_init(&job.mutex, 0);
+  if (nThreads > nReplicas) nThreads = nReplicas;
+  start = time(0);
+  vector<pthread_t> threads(nThreads);
+  for (int it = 0; it < nThreads; it++) pthread_create(&threads[it], 0, bootstrapThread, &job);
+  for (int it = 0; it < nThreads; it++) pthread_join(threads[it], 0);
+  pthread_mutex_destroy(&job.mutex);
+  cout << nReplicas << " replicas done in " << time(0) - start << " s with " << nThreads << " threads" << endl;
+
+  vector<double> rmsB, rmsC, ratioB, ratioC;
+  binSpread(job.contentB, nReplicas, sampleB.total, rmsB, ratioB);
+  binSpread(job.contentC, nReplicas, sampleC.total, rmsC, ratioC);
+
+  //
+  //  Nominal fit with the summed templates, and the spread of the
+  //  replica fits
+  //
+  vector<templateFitTask_t> nominal(dataFile ? nPt : 0);
+  for (unsigned int k = 0; k < nominal.size(); k++) {
+    nominal[k].data = data.contentOf(k);
+    nominal[k].b = sampleB.total.contentOf(k);
+    nominal[k].b2 = sampleB.total.error2Of(k);
+    nominal[k].c = sampleC.total.contentOf(k);
+    nominal[k].c2 = sampleC.total.error2Of(k);
+    nominal[k].n = data.nPhi;
+  }
+  fitTemplatesParallel(nominal, nThreads);
+  vector<double> meanFraction(nPt, 0.), rmsFraction(nPt, 0.);
+  vector<int> nFits(nPt, 0);
+  for (int k = 0; dataFile && k < nPt; k++) {
+    double sum = 0, sum2 = 0;
+    for (int ir = 0; ir < nReplicas; ir++) {
+      if (job.fitStatus[ir*nPt + k] != 0) continue;
+      double f = job.fractionB[ir*nPt + k];
+      sum += f;
+      sum2 += f*f;
+      nFits[k]++;
+    }
+    if (nFits[k] < 2) continue;
+    meanFraction[k] = sum/nFits[k];
+    double var = (sum2 - nFits[k]*meanFraction[k]*meanFraction[k])/(nFits[k] - 1);
+    rmsFraction[k] = var > 0 ? sqrt(var) : 0;
+  }
+
+  //
+  //  Table: bootstrap RMS / error of the nominal sum (mean over
+  //  the delta-phi bins) and, with data, the B fraction
+  //
+  char line[256];
+  if (dataFile)
+    sprintf(line, "%7s %7s %8s %8s %8s %8s %8s %8s %5s", "pT low", "pT high", "RMS/errB", "RMS/errC",
+	    "fB", "dfB fit", "fB boot", "dfB boot", "fits");
+  else
+    sprintf(line, "%7s %7s %8s %8s", "pT low", "pT high", "RMS/errB", "RMS/errC");
+  cout << line << endl;
+  for (int k = 0; k < nPt; k++) {
+    if (dataFile)
+      sprintf(line, "%7.2f %7.2f %8.3f %8.3f %8.4f %8.4f %8.4f %8.4f %5d", ptEdges[k], ptEdges[k+1],
+	      ratioB[k], ratioC[k], nominal[k].result.fB, nominal[k].result.fBError,
+	      meanFraction[k], rmsFraction[k], nFits[k]);
+    else
+      sprintf(line, "%7.2f %7.2f %8.3f %8.3f", ptEdges[k], ptEdges[k+1], ratioB[k], ratioC[k]);
+    cout << line << endl;
+  }
+
+  if (output) {
+    TFile *file = TFile::Open(output, "RECREATE");
+    if (!file || file->IsZombie()) {
+      cout << "Error: cannot write '" << output << "'" << endl;
+      return 1;
+    }
+    string name = "bootstrapRMS" + sampleB.histname;
+    writeSpread(name.c_str(), rmsB, sampleB.total, reference);
+    name = "bootstrapRMS" + sampleC.histname;
+    writeSpread(name.c_str(), rmsC, sampleC.total, reference);
+    if (dataFile) {
+      TH1D *hFraction = new TH1D("bootstrapFractionB", "B fraction, bootstrap RMS;p_{T}^{e} (GeV/c);f_{B}",
+				 nPt, &ptEdges[0]);
+      for (int k = 0; k < nPt; k++) {
+	hFraction->SetBinContent(k+1, nominal[k].result.fB);
+	hFraction->SetBinError(k+1, rmsFraction[k]);
+      }
+    }
+    file->Write();
+    file->Close();
+    cout << "Bootstrap spreads written to '" << output << "'" << endl;
+  }
+  return 0;
+}
@@ -14,34 +14,321 @@
 //==============================================================================
 #include <ctime>
 #include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+#include <cstdlib>
 #include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include "Pythia.h"
 #include "TTree.h"
 #include "TFile.h"
 #include "TH2D.h"
-#include "TH3D.h"
+#include "TH3F.h"
+#include "TH1D.h"
+#include "NPEHAnalysis.h"
+#include "NPEHMerge.h"
 #define PR(x) std::cout << #x << " = " << (x) << std::endl;
 using namespace Pythia8; 
 
+//
+//  Side files of a generator loop, next to the ROOT file
+//
+struct outputFiles_t {
+  string checkpoint;         // see writeCheckpoint()
+  string records;            // event record (NPE:saveEvents)
+};
+
+//
+//  Adaptive stopping (NPE:targetPrecision, NPE:cpuBudget). A
+//  target is a range of electron pT and the relative uncertainty
+//  wanted for the yield of histos2D<name>0 in that range.
+//
+struct precisionTarget_t {
+  double ptLow;
+  double ptHigh;
+  double relError;
+};
+
+//
+//  Shared by all generator loops of a process: each loop (slot)
+//  posts the sums of its own histograms, the monitor adds them up
+//  and decides for all. Everything below the mutex is protected
+//  by it.
+//
+struct stoppingMonitor_t {
+  vector<precisionTarget_t> targets;
+  double cpuBudget;          // CPU seconds for generation, 0 = unlimited
+  double cpuStart;
+  int nSlots;
+  pthread_mutex_t mutex;
+  double cpuInit;            // CPU seconds of Pythia inits after cpuStart (--threads)
+  int nBins;                 // delta-phi bins of histos2D<name>0
+  vector<double> sumw;       // [(slot*targets.size() + k)*nBins + iy]
+  vector<double> sumw2;
+  bool done;                 // all targets met or budget used up
+  string reason;
+};
+
+//
+//  Cross-section and weight bookkeeping of one generator loop (or
+//  pTHat slice). sigmaSum is sigmaGen times the Pythia events it
+//  was estimated from, so that the loops of several threads,
+//  workers or checkpointed pieces simply add up. nAccepted also
+//  counts the events vetoed at parton level, nSurvived only those
+//  next() returned. sumW is the sum of the Pythia event weights
+//  (info.weight(), 1 unless biased) of the latter, analyzedSumW
+//  that of the full weights of the analyzed events.
+//  The veto hook counts are those of this loop only.
+//
+struct generatorStats_t {
+  generatorStats_t() : nAccepted(0), sigmaSum(0), numberOfEvents(0), nSurvived(0),
+		       sumW(0), sumW2(0), analyzedSumW(0), analyzedSumW2(0),
+		       nProcess(0), nProcessVetoed(0), nParton(0), nPartonVetoed(0) {}
+  void add(const generatorStats_t &other) {
+    nAccepted += other.nAccepted;
+    sigmaSum += other.sigmaSum;
+    numberOfEvents += other.numberOfEvents;
+    nSurvived += other.nSurvived;
+    sumW += other.sumW;
+    sumW2 += other.sumW2;
+    analyzedSumW += other.analyzedSumW;
+    analyzedSumW2 += other.analyzedSumW2;
+    nProcess += other.nProcess;
+    nProcessVetoed += other.nProcessVetoed;
+    nParton += other.nParton;
+    nPartonVetoed += other.nPartonVetoed;
+  }
+  long   nAccepted;          // events accepted by Pythia
+  double sigmaSum;           // sigmaGen [mb] * nAccepted
+  long   numberOfEvents;     // of those, analyzed (with a c/b electron)
+  long   nSurvived;          // returned by next(), i.e. not vetoed
+  double sumW;               // Pythia weights of the surviving events
+  double sumW2;
+  double analyzedSumW;       // weights of the analyzed events
+  double analyzedSumW2;
+  long   nProcess;           // NPE:vetoHook: events seen and vetoed at process level
+  long   nProcessVetoed;
+  long   nParton;            // and at parton level
+  long   nPartonVetoed;
+};
+
+const int kSliceInfoBins = 5;   // bins per slice in pTHatSlices<name>, see writeSliceInfo()
+
+//
+//  State of one generator thread. Each worker owns its own
+//  Pythia instance and its own set of histograms, so nothing
+//  is shared while events are generated. The histograms are
+//  summed into the ones attached to the output file at the end.
+//
+struct generatorJob_t {
+  int ithread;
+  int seed;                  // derived from the runcard seed
+  int maxNumberOfEvents;     // this thread's share of the events
+  const char* runcard;
+  const char* xmlDB;
+  outputFiles_t files;       // checkpoint and event record of this thread
+  vector<TH2D*> histos2D;
+  vector<TH3F*> histos3D;
+  int numberOfEvents;        // filled by the worker
+  int numberOfElectrons;
+  int iErrors;
+  perfCounters_t perf;
+  stoppingMonitor_t *monitor;  // shared by all threads, 0 if not adaptive
+  vector<generatorStats_t> sliceStats;  // per pTHat slice
+};
+
+//
+//  Pre-filter that vetoes events before hadronization when no
+//  c/b quark could plausibly give an electron in our acceptance.
+//  At process level the hard process must contain a c/b quark
+//  with pT above NPE:vetoMinPt; after the showers one of the
+//  final-state c/b quarks must in addition have |eta| below
+//  NPE:vetoMaxEta. Both cuts have to be looser than the electron
+//  cuts since the hadron and its decay smear pT and eta.
+//
+class HeavyFlavorVeto : public UserHooks {
+public:
+  HeavyFlavorVeto(double minPt, double maxEta) :
+    mMinPt(minPt), mMaxEta(maxEta),
+    nProcess(0), nProcessVetoed(0), nParton(0), nPartonVetoed(0) {}
+
+  virtual bool canVetoProcessLevel() {return true;}
+  virtual bool doVetoProcessLevel(Event& process) {
+    nProcess++;
+    if (hasHeavyQuark(process, false)) return false;
+    nProcessVetoed++;
+    return true;
+  }
+
+  virtual bool canVetoPartonLevel() {return true;}
+  virtual bool doVetoPartonLevel(const Event& event) {
+    nParton++;
+    if (hasHeavyQuark(event, true)) return false;
+    nPartonVetoed++;
+    return true;
+  }
+
+  double mMinPt;
+  double mMaxEta;
+  long nProcess;        // events seen at process level
+  long nProcessVetoed;
+  long nParton;         // events seen at parton level
+  long nPartonVetoed;
+
+private:
+  bool hasHeavyQuark(const Event& event, bool cutEta) const {
+    for (int i = 0; i < event.size(); i++) {
+      int id = abs(event[i].id());
+      if (id != 4 && id != 5) continue;
+      if (cutEta && !event[i].isFinal()) continue;
+      if (event[i].pT() < mMinPt) continue;
+      if (cutEta && fabs(event[i].eta()) > mMaxEta) continue;
+      return true;
+    }
+    return false;
+  }
+};
+
+//
+//  Forced decays (NPE:forceSemileptonic). Pythia leaves all c/b
+//  hadrons undecayed; forceTriggerChain() then forces the decay
+//  chain of one of them and decays the rest of the event as usual.
+//  Per hadron the channels switched off while it is forced and
+//  the fraction of the BR they leave on.
+//
+struct forcedDecays_t {
+  bool empty() const { return ids.empty(); }
+  set<int> ids;                          // all c/b hadrons, mayDecay off in Pythia
+  map<int, vector<int> > offChannels;    // channels switched off when forced
+  map<int, double> keptFraction;         // BR fraction of the channels left on
+};
+
+//
+//  What setupPythia() prepares besides Pythia itself
+//
+struct generatorSetup_t {
+  generatorSetup_t() : veto(0), decayPasses(1), monitor(0), monitorSlot(0) {}
+  forcedDecays_t forced;     // empty unless decays are forced
+  HeavyFlavorVeto *veto;     // 0 if the veto hook is off
+  vector<cutSet_t> cutSets;  // from NPE:cutSets, set 0 is the default
+  vector<double> pTHatBins;  // from NPE:pTHatBins, slice edges; empty if not sliced
+  int decayPasses;           // NPE:decayOversample, decay passes per parton-level event
+  stoppingMonitor_t *monitor;  // set by the caller, 0 for a fixed number of events
+  int monitorSlot;
+};
+
 //
 //  Forward declarations
 //
-bool isInAcceptanceE(int, const Event&);  // acceptance filter electron candidate
-bool isInAcceptanceH(int, const Event&);  // acceptance filter hadron candidate
-int myEvent(Pythia&, vector<TH2D*> &, vector<TH3D*>&, double); // event handler (analyze event)
-double deltaPhi(double, double); 
-double deltaEta(double, double);
+int myEvent(Pythia&, eventSnapshot_t&, vector<TH2D*> &, vector<TH3F*>&, const vector<cutSet_t>&,
+	    double, perfCounters_t&, int); // event handler (analyze event)
+void fillSnapshot(const Event&, eventSnapshot_t&, int);
+void labelHeavyFlavorAncestors(const Event&, vector<int>&);
+void addNpeSettings(Settings&);
+void setupPythia(Pythia&, const char*, int, bool, generatorSetup_t&);
+int generateEvents(Pythia&, vector<TH2D*>&, vector<TH3F*>&, int, int&, int&, const char*, const outputFiles_t&,
+		   const generatorSetup_t&, perfCounters_t&, generatorStats_t&);
+int generateSlices(Pythia&, vector<TH2D*>&, vector<TH3F*>&, int, int&, int&, const char*, const outputFiles_t&,
+		   const generatorSetup_t&, perfCounters_t&, vector<generatorStats_t>&);
+void countVetoes(const HeavyFlavorVeto*, const generatorStats_t&, generatorStats_t&);
+bool parsePTHatBins(const string&, vector<double>&);
+void bookSliceHistograms(vector<TH2D*>&, vector<TH3F*>&, const char*, int, int);
+TH1D* writeSliceInfo(const vector<generatorStats_t>&, const vector<double>&, const char*);
+void writeWeightInfo(const vector<generatorStats_t>&, const char*);
+bool weightedFills(Settings&);
+void stitchSlices(vector<TH2D*>&, vector<TH3F*>&, int, const TH1D*);
+bool stitchSlicesInFile(const char*, const char*, int, int);
+void printPerf(const char*, const perfCounters_t&);
+void writePerfSummary(const perfCounters_t&, const char*);
+bool fillRecord(const Event&, const eventSnapshot_t&, vector<npeRecordParticle_t>&);
+int reanalyzeRecords(const char*, vector<TH2D*>&, vector<TH3F*>&, const vector<cutSet_t>&, int&);
+void forceSemileptonicDecays(ParticleData&, forcedDecays_t&);
+int forceTriggerChain(Pythia&, const forcedDecays_t&, double&);
+void* generatorThread(void*);
+int runCampaign(const char*, const char*, const char*, const char*, int, int, int);
+int runForked(const char*, const char*, const char*, const char*, int);
+int campaignWorker(const char*, const string&, const char*, const char*, int);
+string cardValue(const char*, const char*);
+string prepareInitCache(const char*, const char*, const char*);
+bool makeDirectories(const string&);
+bool copyFile(const string&, const string&);
+bool copyDirectory(const string&, const string&);
+void removeDirectory(const string&);
+outputFiles_t outputFileNames(const char*, int);
+void writeCheckpoint(Pythia&, vector<TH2D*>&, vector<TH3F*>&, int, int, int, long, const generatorStats_t&,
+		     const string&);
+bool readCheckpoint(Pythia&, vector<TH2D*>&, vector<TH3F*>&, int&, int&, int&, long&, generatorStats_t&,
+		    const string&);
+void removeCheckpoint(const string&);
+bool rndmStateToText(Pythia&, const string&, string&);
+bool rndmStateFromText(Pythia&, const string&, const string&);
+bool parsePrecisionTargets(const string&, vector<precisionTarget_t>&);
+bool initMonitor(stoppingMonitor_t&, Settings&, int, double, double);
+bool updateMonitor(stoppingMonitor_t&, int, vector<TH2D*>&, const char*, bool);
+double cpuSeconds();
+double threadCpuSeconds();
+
+pthread_mutex_t initMutex = PTHREAD_MUTEX_INITIALIZER;  // Pythia/LHAPDF init is not reentrant
+pthread_mutex_t coutMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rootIOMutex = PTHREAD_MUTEX_INITIALIZER; // ROOT file I/O from worker threads
 
 int main(int argc, char* argv[]) {
     
-  if (argc != 4) {
-    cout << "Usage: " << argv[0] << " runcard rootfile histName" << endl;
+  //
+  //  Positional arguments first, then options:
+  //    --threads N   run N independent Pythia instances in this process
+  //    --reanalyze   first argument is an event record file (NPE:saveEvents)
+  //                  instead of a runcard; rerun the analysis on it
+  //    --cuts S      with --reanalyze: cut sets as in NPE:cutSets
+  //    --campaign F:L  one run per seed F..L of the runcard, merged
+  //                    into rootfile; --jobs N of them at a time
+  //    --fork N      initialize Pythia once, then fork N generator
+  //                  processes that share it
+  //
+  vector<char*> args;
+  int nThreads = 1;
+  int nForks = 1;
+  bool reanalyze = false;
+  const char* cutSpec = 0;
+  int firstSeed = 0;
+  int lastSeed = -1;
+  int nJobs = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i+1 < argc) nThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--campaign") && i+1 < argc) {
+      if (sscanf(argv[++i], "%d:%d", &firstSeed, &lastSeed) != 2) lastSeed = -2;
+    }
+    else if (!strcmp(argv[i], "--jobs") && i+1 < argc) nJobs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--fork") && i+1 < argc) nForks = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--reanalyze")) reanalyze = true;
+    else if (!strcmp(argv[i], "--cuts") && i+1 < argc) cutSpec = argv[++i];
+    else args.push_back(argv[i]);
+  }
+  bool campaign = lastSeed != -1;
+  if (args.size() != 3 || nThreads < 1 || (cutSpec && !reanalyze) || nJobs < 1 ||
+      (campaign && (lastSeed < firstSeed || firstSeed < 1 || reanalyze || nThreads > 1)) ||
+      nForks < 1 || (nForks > 1 && (campaign || reanalyze || nThreads > 1))) {
+    cout << "Usage: " << argv[0] << " runcard rootfile histName [--threads N | --fork N]" << endl;
+    cout << "       " << argv[0] << " --reanalyze records rootfile histName [--cuts S]" << endl;
+    cout << "       " << argv[0] << " runcard rootfile histName --campaign firstSeed:lastSeed [--jobs N]" << endl;
     return 2;
   }
-  char* runcard  = argv[1];
-  char* rootfile = argv[2];
-  char* histname = argv[3];
+  char* runcard  = args[0];
+  char* rootfile = args[1];
+  char* histname = args[2];
   const char* xmlDB    = "/star/u/zbtang/myTools/pythia8142/xmldoc";
+  const char* pdfSets  = "/star/u/zbtang/myTools/lhapdf570/share/lhapdf/PDFsets";  // unless LHAPATH is set
     
   //--------------------------------------------------------------
   //  Initialization
@@ -51,82 +338,321 @@ int main(int argc, char* argv[]) {
   cout << "============================================================================" \
        << endl;
   cout << "Executing program '" << argv[0] << "', start at: " << ctime(&now);
-  cout << "Arguments: " << argv[1] << " " << argv[2] << " " << argv[3] << endl;
+  cout << "Arguments: " << runcard << " " << rootfile << " " << histname;
+  if (reanalyze) cout << " --reanalyze";
+  if (cutSpec) cout << " --cuts " << cutSpec;
+  if (nThreads > 1) cout << " --threads " << nThreads;
+  if (campaign) cout << " --campaign " << firstSeed << ":" << lastSeed << " --jobs " << nJobs;
+  if (nForks > 1) cout << " --fork " << nForks;
+  cout << endl;
   cout << "============================================================================" \
        << endl;
+
+  //
+  //  Read the xmldoc and the PDF grid from a node-local copy
+  //  (NPE:initCacheDir)
+  //
+  string xmlDir = xmlDB;
+  if (!reanalyze) xmlDir = prepareInitCache(runcard, xmlDB, pdfSets);
+  xmlDB = xmlDir.c_str();
     
+  if (campaign) {
+    int status = runCampaign(runcard, rootfile, histname, xmlDB, firstSeed, lastSeed, nJobs);
+    now = time(0);
+    cout << "Campaign finished at: " << ctime(&now);
+    return status;
+  }
+  if (nForks > 1) {
+    int status = runForked(runcard, rootfile, histname, xmlDB, nForks);
+    now = time(0);
+    cout << "Program finished at: " << ctime(&now);
+    return status;
+  }
+
   //
-  //  ROOT
+  //  ROOT. The histograms are booked once the number of cut
+  //  sets is known.
   //
-  char text[64];
   TFile *hfile  = new TFile(rootfile,"RECREATE");
   vector<TH2D*> histos2D;
-  sprintf(text,"histos2D%s%d",histname,0);
-  histos2D.push_back(new TH2D(text,"NPE - h", 150,0.,15.,200, -0.5*M_PI, 1.5*M_PI));
-  sprintf(text,"histos2D%s%d",histname,1);
-  histos2D.push_back(new TH2D(text,"NPE pt vs y", 150, 0., 15., 60, -3, 3));
-  sprintf(text,"histos2D%s%d",histname,2);
-  histos2D.push_back(new TH2D(text,"near-side Nch", 150, 0, 15, 50, 0., 50.));
-  sprintf(text,"histos2D%s%d",histname,3);
-  histos2D.push_back(new TH2D(text,"away-side Nch", 150, 0, 15, 50, 0., 50.));
-  sprintf(text,"histos2D%s%d",histname,4);
-  histos2D.push_back(new TH2D(text,"near-side pt", 150, 0, 15, 150, 0., 15.));
-  sprintf(text,"histos2D%s%d",histname,5);
-  histos2D.push_back(new TH2D(text,"away-side pt", 150, 0, 15, 150, 0., 15.));
-  sprintf(text,"histos2D%s%d",histname,6);
-  histos2D.push_back(new TH2D(text,"near-side m0", 150, 0, 15, 100, 0., 1.));
-  sprintf(text,"histos2D%s%d",histname,7);
-  histos2D.push_back(new TH2D(text,"away-side m0", 150, 0, 15, 100, 0., 1.));
-  sprintf(text,"histos2D%s%d",histname,8);
-  histos2D.push_back(new TH2D(text,"pt balance", 150, 0, 15, 100, -10, 10.));
-  sprintf(text,"histos2D%s%d",histname,9);
-  histos2D.push_back(new TH2D(text,"B daughter pt", 150, 0, 15, 150, 0, 15.));
-
-  vector<TH3D*> histos3D;
-  sprintf(text,"histo3D%s%d",histname,0);
-  histos3D.push_back(new TH3D(text,"NPE - h", 150,0.,15., 150,0,15, 200, -10., 10.));
-  sprintf(text,"histo3D%s%d",histname,1);
-  histos3D.push_back(new TH3D(text,"NPE - B-->h", 150,0.,15.,150,0,15,200, -0.5*M_PI, 1.5*M_PI));
-
-
-  //
-  //  Create instance of Pythia 
-  //
-  Pythia pythia(xmlDB); // the init parameters are read from xml files
-  // stored in the xmldoc directory. This includes
-  // particle data and decay definitions.
+  vector<TH3F*> histos3D;
+  vector<cutSet_t> cutSets;
+  perfCounters_t perf;
+  vector<double> pTHatBins;
+  vector<generatorStats_t> sliceStats;
+
+  int ievent = 0;
+  int numberOfElectrons = 0;
+  int iErrors = 0;
+
+  if (reanalyze) {
+    //
+    //  No generation: the event record replaces Pythia
+    //
+    if (!parseCutSets(cutSpec ? cutSpec : "", cutSets)) {
+      cout << "Error: malformed cut sets '" << cutSpec << "'" << endl;
+      return 2;
+    }
+    bookHistograms(histos2D, histos3D, histname, cutSets.size());
+    enableWeights(histos2D, histos3D);
+    ievent = reanalyzeRecords(runcard, histos2D, histos3D, cutSets, numberOfElectrons);
+    if (ievent < 0) {
+      cout << "Error: cannot read event record '" << runcard << "'" << endl;
+      return 1;
+    }
+  }
+  else if (nThreads == 1) {
+    //
+    //  Create instance of Pythia 
+    //
+    Pythia pythia(xmlDB); // the init parameters are read from xml files
+    // stored in the xmldoc directory. This includes
+    // particle data and decay definitions.
+    generatorSetup_t setup;
+    setupPythia(pythia, runcard, -1, true, setup);
+    int maxNumberOfEvents = pythia.settings.mode("Main:numberOfEvents");
+    cutSets = setup.cutSets;
+    pTHatBins = setup.pTHatBins;
+    bookSliceHistograms(histos2D, histos3D, histname, cutSets.size(), pTHatBins.size());
+    if (weightedFills(pythia.settings)) enableWeights(histos2D, histos3D);
+    stoppingMonitor_t monitor;
+    if (initMonitor(monitor, pythia.settings, 1, 1, 1)) setup.monitor = &monitor;
+    ievent = generateSlices(pythia, histos2D, histos3D, maxNumberOfEvents, numberOfElectrons, iErrors,
+			    "", outputFileNames(rootfile, -1), setup, perf, sliceStats);
+    if (setup.pTHatBins.empty()) pythia.statistics();   // per slice in generateSlices()
+    delete setup.veto;
+  }
+  else {
+    //
+    //  One Pythia instance per thread. Each thread gets its own
+    //  copy of the (empty) histograms and its share of the events.
+    //  The runcard is read once here only to split the event count
+    //  and to derive the per-thread seeds.
+    //
+    Pythia cardReader(xmlDB);
+    addNpeSettings(cardReader.settings);
+    cardReader.readFile(runcard);
+    int maxNumberOfEvents = cardReader.settings.mode("Main:numberOfEvents");
+    int baseSeed = cardReader.settings.mode("Random:seed");
+    //
+    //  LHAPDF 5 keeps its grid in Fortran common blocks, so PDF
+    //  calls from several threads race and corrupt the events.
+    //  --fork gives each worker its own copy.
+    //
+    if (cardReader.settings.flag("PDF:useLHAPDF")) {
+      cout << "Error: --threads cannot be used with PDF:useLHAPDF = on (LHAPDF 5 is not reentrant); "
+	   << "use --fork " << nThreads << " instead" << endl;
+      return 2;
+    }
+    if (!parseCutSets(cardReader.settings.word("NPE:cutSets"), cutSets)) {
+      cout << "Error: malformed NPE:cutSets in '" << runcard << "'" << endl;
+      return 2;
+    }
+    if (!parsePTHatBins(cardReader.settings.word("NPE:pTHatBins"), pTHatBins)) {
+      cout << "Error: malformed NPE:pTHatBins in '" << runcard << "'" << endl;
+      return 2;
+    }
+    bookSliceHistograms(histos2D, histos3D, histname, cutSets.size(), pTHatBins.size());
+    if (weightedFills(cardReader.settings)) enableWeights(histos2D, histos3D);
+    stoppingMonitor_t monitor;
+    bool adaptive = initMonitor(monitor, cardReader.settings, nThreads, 1, 1);
+
+    vector<generatorJob_t> jobs(nThreads);
+    vector<pthread_t> threads(nThreads);
+    char text[64];
+    for (int it = 0; it < nThreads; it++) {
+      generatorJob_t &job = jobs[it];
+      job.ithread = it;
+      job.seed = (baseSeed + 1000003*it) % 900000000;  // large stride keeps clear of neighbouring cards
+      job.maxNumberOfEvents = maxNumberOfEvents/nThreads + (it < maxNumberOfEvents%nThreads ? 1 : 0);
+      job.runcard = runcard;
+      job.xmlDB = xmlDB;
+      job.files = outputFileNames(rootfile, it);
+      job.monitor = adaptive ? &monitor : 0;
+      for (unsigned int k = 0; k < histos2D.size(); k++) {
+	sprintf(text, "%s_t%d", histos2D[k]->GetName(), it);
+	job.histos2D.push_back(static_cast<TH2D*>(histos2D[k]->Clone(text)));
+	job.histos2D.back()->SetDirectory(0);
+      }
+      for (unsigned int k = 0; k < histos3D.size(); k++) {
+	sprintf(text, "%s_t%d", histos3D[k]->GetName(), it);
+	job.histos3D.push_back(static_cast<TH3F*>(histos3D[k]->Clone(text)));
+	job.histos3D.back()->SetDirectory(0);
+      }
+      pthread_create(&threads[it], 0, generatorThread, &job);
+    }
+
+    //
+    //  Reduce the per-thread histograms into the output file
+    //
+    for (int it = 0; it < nThreads; it++) {
+      pthread_join(threads[it], 0);
+      generatorJob_t &job = jobs[it];
+      for (unsigned int k = 0; k < histos2D.size(); k++) {
+	histos2D[k]->Add(job.histos2D[k]);
+	delete job.histos2D[k];
+      }
+      for (unsigned int k = 0; k < histos3D.size(); k++) {
+	histos3D[k]->Add(job.histos3D[k]);
+	delete job.histos3D[k];
+      }
+      ievent += job.numberOfEvents;
+      numberOfElectrons += job.numberOfElectrons;
+      iErrors += job.iErrors;
+      perf.add(job.perf);
+      sliceStats.resize(job.sliceStats.size());
+      for (unsigned int k = 0; k < job.sliceStats.size(); k++) sliceStats[k].add(job.sliceStats[k]);
+    }
+    cout << "All " << nThreads << " threads done: # of events generated = " << ievent
+	 << ", # of electrons from c/b hadron decays = " << numberOfElectrons
+	 << ", # of errors = " << iErrors << endl;
+  }
+    
+  //--------------------------------------------------------------
+  //  Finish up
+  //--------------------------------------------------------------
+  if (!reanalyze) {
+    printPerf("", perf);
+    writePerfSummary(perf, histname);
+  }
+  if (!reanalyze) writeWeightInfo(sliceStats, histname);
+  if (!pTHatBins.empty()) stitchSlices(histos2D, histos3D, cutSets.size(), writeSliceInfo(sliceStats, pTHatBins, histname));
+  cout << "Writing File" << endl;
+  double tWrite = perfClock();
+  hfile->Write();
+  hfile->Close();
+  cout << "File written in " << perfClock() - tWrite << " s" << endl;
+
+  //
+  //  Output is safe on disk, checkpoints are obsolete
+  //
+  if (!reanalyze && nThreads == 1) removeCheckpoint(outputFileNames(rootfile, -1).checkpoint);
+  for (int it = 0; !reanalyze && nThreads > 1 && it < nThreads; it++) removeCheckpoint(outputFileNames(rootfile, it).checkpoint);
+
+  now = time(0);
+  cout << "============================================================================\
+" << endl;
+  cout << "Program finished at: " << ctime(&now);
+  cout << "============================================================================\
+" << endl;
     
+  return 0;
+}
+
+//
+//  Our own runcard settings. They have to be known to Pythia
+//  before the runcard is read, otherwise they are rejected.
+//
+void addNpeSettings(Settings &settings)
+{
+  // write a checkpoint every this many accepted events (0 = never)
+  settings.addMode("NPE:checkpointEvery", 0, true, false, 0, 0);
+  // force c/b hadrons into electron channels, reweight events by the BRs
+  settings.addFlag("NPE:forceSemileptonic", false);
+  // veto events without a suitable c/b quark before hadronization
+  settings.addFlag("NPE:vetoHook", false);
+  settings.addParm("NPE:vetoMinPt", 0., true, false, 0., 0.);
+  settings.addParm("NPE:vetoMaxEta", 2.5, true, false, 0., 0.);
+  // save accepted events to a record file for --reanalyze
+  settings.addFlag("NPE:saveEvents", false);
+  // extra acceptance cut sets "etaE,etaH,ptMinH,ptMinAssoc/..."
+  settings.addWord("NPE:cutSets", "void");
+  // node-local cache of xmldoc and PDF grid (used before Pythia exists, see prepareInitCache)
+  settings.addWord("NPE:initCacheDir", "void");
+  // stop when the yield in each electron pT range "ptLow-ptHigh:relError/..." is that precise
+  settings.addWord("NPE:targetPrecision", "void");
+  // or when this many CPU seconds are used for generation (0 = no limit)
+  settings.addParm("NPE:cpuBudget", 0., true, false, 0., 0.);
+  // generate in pTHat slices "e0,e1,...,eN" (eN = -1: open) and stitch them by cross section
+  settings.addWord("NPE:pTHatBins", "void");
+  // decay each parton-level event this many times, each pass weighted 1/K
+  settings.addMode("NPE:decayOversample", 1, true, false, 1, 0);
+}
+
+//
+//  Read the runcard and initialize Pythia. A seed >= 0 overrides
+//  the one in the runcard (used for the per-thread seeds).
+//  If decays are forced, setup.forced returns the channels and the
+//  fraction of the original BR kept for each c/b hadron; setup.veto
+//  is the veto hook if requested (owned by the caller).
+//
+void setupPythia(Pythia &pythia, const char* runcard, int seed, bool verbose,
+		 generatorSetup_t &setup)
+{
   //
   // Shorthand for (static) settings
   //
   Settings& settings = pythia.settings;
+  addNpeSettings(settings);
     
   //
   //  Read in runcard
   //
   pythia.readFile(runcard);  
-  cout << "Runcard '" << runcard << "' loaded." << endl;
+  if (verbose) cout << "Runcard '" << runcard << "' loaded." << endl;
+  if (seed >= 0) {
+    char text[64];
+    pythia.readString("Random:setSeed = on");
+    sprintf(text, "Random:seed = %d", seed);
+    pythia.readString(text);
+  }
     
   //
-  //  Retrieve number of events and other parameters from the runcard.
-  //  We need to deal with those settings ourself. Getting
-  //  them through the runcard just avoids recompiling.
+  //  Most c/b hadrons do not decay into an electron. To save
+  //  processing time we optionally force the decay chain of one
+  //  c/b hadron per event into an electron; the BRs differ for
+  //  the various hadrons, so each event is then weighted by the
+  //  BR fractions of the forced decays (see forceTriggerChain()).
   //
-  int  maxNumberOfEvents = settings.mode("Main:numberOfEvents");
-  int  nList     = settings.mode("Main:numberToList");
-  int  nShow     = settings.mode("Main:timesToShow");
-  int  maxErrors = settings.mode("Main:timesAllowErrors");
-  bool showCS    = settings.flag("Main:showChangedSettings");
-  bool showAS    = settings.flag("Main:showAllSettings");
-  int  pace = maxNumberOfEvents/nShow;
- 
+  setup.forced = forcedDecays_t();
+  if (settings.flag("NPE:forceSemileptonic")) {
+    forceSemileptonicDecays(pythia.particleData, setup.forced);
+    if (verbose) cout << "Forced semileptonic decays for " << setup.forced.keptFraction.size() << " c/b hadrons." << endl;
+  }
+
+  //
+  //  Cut sets besides the default one, each with its own histograms
+  //
+  if (!parseCutSets(settings.word("NPE:cutSets"), setup.cutSets)) {
+    cout << "Error: malformed NPE:cutSets '" << settings.word("NPE:cutSets") << "', using the default cuts only" << endl;
+    setup.cutSets.assign(1, defaultCuts());
+  }
+  if (verbose && setup.cutSets.size() > 1) cout << setup.cutSets.size() << " cut sets." << endl;
+
+  //
+  //  pTHat slices: Pythia starts in the first one, generateSlices()
+  //  moves on to the others
+  //
+  if (!parsePTHatBins(settings.word("NPE:pTHatBins"), setup.pTHatBins)) {
+    cout << "Error: malformed NPE:pTHatBins '" << settings.word("NPE:pTHatBins") << "', not slicing" << endl;
+    setup.pTHatBins.clear();
+  }
+  if (!setup.pTHatBins.empty()) {
+    char text[64];
+    sprintf(text, "PhaseSpace:pTHatMin = %g", setup.pTHatBins[0]);
+    pythia.readString(text);
+    sprintf(text, "PhaseSpace:pTHatMax = %g", setup.pTHatBins[1]);
+    pythia.readString(text);
+    if (verbose) cout << setup.pTHatBins.size()-1 << " pTHat slices." << endl;
+  }
+
+  //
+  //  Decay oversampling: Pythia stops after hadronization and
+  //  generateEvents() does the decays, several times per event
   //
-  //  Remark: in this example we do NOT alter the
-  //  BRs since they are different for the various charm
-  //  hadrons making the normalization at the end rather
-  //  cumbersome. In a production version this is what
-  //  one probably would implement to save processing time.
+  setup.decayPasses = settings.mode("NPE:decayOversample");
+  if (setup.decayPasses > 1) {
+    pythia.readString("HadronLevel:Decay = off");
+    if (verbose) cout << setup.decayPasses << " decay passes per event." << endl;
+  }
+
   //
+  //  Do not hadronize and decay events we would throw away anyhow
+  //
+  if (settings.flag("NPE:vetoHook")) {
+    setup.veto = new HeavyFlavorVeto(settings.parm("NPE:vetoMinPt"), settings.parm("NPE:vetoMaxEta"));
+    pythia.setUserHooksPtr(setup.veto);
+  }
     
   //
   //  Initialize Pythia, ready to go
@@ -136,32 +662,156 @@ int main(int argc, char* argv[]) {
   //
   // List changed or all data
   //
-  if (showCS) settings.listChanged();
-  if (showAS) settings.listAll();
-    
-  //--------------------------------------------------------------
-  //  Event loop
-  //--------------------------------------------------------------
+  if (verbose && settings.flag("Main:showChangedSettings")) settings.listChanged();
+  if (verbose && settings.flag("Main:showAllSettings")) settings.listAll();
+}
+
+//
+//  Event loop. Generates until maxNumberOfEvents events with at
+//  least one c/b electron were analyzed. Returns that number.
+//  The tag is prepended to the progress printout. If checkpointing
+//  is on, the loop resumes from an existing checkpoint file and
+//  refreshes it every NPE:checkpointEvery events. With forced
+//  decays only the electrons of the forced chain are triggers and
+//  each event is weighted accordingly (forceTriggerChain()), on
+//  top of the Pythia event weight (PhaseSpace:bias2Selection).
+//  With decay oversampling (setup.decayPasses = K > 1) Pythia
+//  leaves the hadrons undecayed; each event is then decayed K
+//  times from the same hadron-level record, and every pass is
+//  analyzed with 1/K of the weight. An event counts as accepted
+//  if any pass has a c/b electron.
+//  With NPE:saveEvents every event with a c/b electron candidate
+//  is also appended to the event record file. The phases of the
+//  loop are timed into perf and reported with the progress. With
+//  setup.monitor the loop also ends, before maxNumberOfEvents,
+//  once the monitor says the targets are met or the CPU budget
+//  is used up. stats returns the cross section and event counts
+//  of this loop, including a resumed checkpoint.
+//
+int generateEvents(Pythia &pythia, vector<TH2D*> &histos2D, vector<TH3F*> &histos3D,
+		   int maxNumberOfEvents, int &numberOfElectrons, int &iErrors, const char* tag,
+		   const outputFiles_t &files, const generatorSetup_t &setup, perfCounters_t &perf,
+		   generatorStats_t &stats)
+{
+  const forcedDecays_t &forced = setup.forced;
+
+  //
+  //  Retrieve number of events and other parameters from the runcard.
+  //  We need to deal with those settings ourself. Getting
+  //  them through the runcard just avoids recompiling.
+  //
+  Settings& settings = pythia.settings;
+  int  nList     = settings.mode("Main:numberToList");
+  int  nShow     = settings.mode("Main:timesToShow");
+  int  maxErrors = settings.mode("Main:timesAllowErrors");
+  int  checkpointEvery = settings.mode("NPE:checkpointEvery");
+  bool saveEvents = settings.flag("NPE:saveEvents");
+  int  pace = maxNumberOfEvents/nShow;
+  if (pace < 1) pace = 1;
+  const int monitorEvery = 100;   // accepted events between checks of the stopping monitor
+
   int ievent = 0;
-  int numberOfElectrons = 0;
-  int iErrors = 0;
   int n;
+  double weight = 1;
+  generatorStats_t loop;   // this loop's sums, without the checkpoint
+  const int nPasses = setup.decayPasses;
+  Event undecayed;         // hadron-level record, restored before each decay pass
+  double sumX = 0, sumX2 = 0, sumPass2 = 0;   // weighted triggers per event and per pass, see below
+  eventSnapshot_t snapshot;
+  const string &checkpoint = files.checkpoint;
+  long recordBytes = -1;   // size of the event record at the checkpoint
+  npeRecordWriter_t records;
+  vector<npeRecordParticle_t> record;
+
+  generatorStats_t before;   // from the checkpoint
+  generatorStats_t vetoStart;   // veto counts of the hook when this loop starts
+  if (setup.veto) {
+    vetoStart.nProcess = setup.veto->nProcess;
+    vetoStart.nProcessVetoed = setup.veto->nProcessVetoed;
+    vetoStart.nParton = setup.veto->nParton;
+    vetoStart.nPartonVetoed = setup.veto->nPartonVetoed;
+  }
+  if (checkpointEvery > 0 &&
+      readCheckpoint(pythia, histos2D, histos3D, ievent, numberOfElectrons, iErrors, recordBytes, before, checkpoint))
+    cout << tag << "Resuming from checkpoint '" << checkpoint << "' at event " << ievent << endl;
+  if (saveEvents && !records.open(files.records, recordBytes)) {
+    cout << tag << "Error: cannot open event record '" << files.records << "', events are not saved" << endl;
+    saveEvents = false;
+  }
     
+  double tStart = perfClock();
+  double wallBefore = perf.wall;
+  double t0, t1;
   while (ievent < maxNumberOfEvents) {
         
-    if (!pythia.next()) {
+    t0 = perfClock();
+    long vetoed = setup.veto ? setup.veto->nProcessVetoed + setup.veto->nPartonVetoed : 0;
+    bool ok = pythia.next();
+    t1 = perfClock();
+    perf.seconds[perfCounters_t::kGenerate] += t1 - t0;
+    if (!ok) {
+      //
+      //  A veto of the hook makes next() fail as well; it is
+      //  no error
+      //
+      if (setup.veto && setup.veto->nProcessVetoed + setup.veto->nPartonVetoed != vetoed) continue;
       if (++iErrors < maxErrors) continue;
-      cout << "Error: too many errors in event generation - check your settings & code" << endl;
+      cout << tag << "Error: too many errors in event generation - check your settings & code" << endl;
       break;
     }
-    n = myEvent(pythia, histos2D, histos3D, maxNumberOfEvents);  // in myEvent we deal with the whole event and return
-    // the number of electrons recorded for book keeping
+    perf.events++;
+    double eventWeight = pythia.info.weight();
+    loop.nSurvived++;
+    loop.sumW += eventWeight;
+    loop.sumW2 += eventWeight*eventWeight;
+    if (nPasses > 1) undecayed = pythia.event;
+    n = 0;
+    double x = 0;
+    for (int pass = 0; pass < nPasses; pass++) {
+      if (nPasses > 1) {
+	t0 = perfClock();
+	if (pass > 0) pythia.event = undecayed;
+	pythia.moreDecays();
+	perf.seconds[perfCounters_t::kGenerate] += perfClock() - t0;
+      }
+      weight = eventWeight/nPasses;
+      int triggerParent = -1;
+      if (!forced.empty()) {
+	t0 = perfClock();
+	triggerParent = forceTriggerChain(pythia, forced, weight);
+	perf.seconds[perfCounters_t::kGenerate] += perfClock() - t0;
+      }
+      int nPass = myEvent(pythia, snapshot, histos2D, histos3D, setup.cutSets, weight, perf,
+			  triggerParent);  // in myEvent we deal with the whole event and return
+      // the number of electrons recorded for book keeping
+      if (saveEvents) {
+	t0 = perfClock();
+	if (fillRecord(pythia.event, snapshot, record)) records.addEvent(record, weight);
+	perf.seconds[perfCounters_t::kOutput] += perfClock() - t0;
+      }
+      if (nPass == 0) continue;
+      n += nPass;
+      x += weight*nPass;
+      sumPass2 += weight*nPass*weight*nPass;
+      loop.analyzedSumW += weight;
+      loop.analyzedSumW2 += weight*weight;
+    }
     if(n == 0) continue;
     numberOfElectrons += n; 
+    sumX += x;
+    sumX2 += x*x;
     ievent++;
+    perf.accepted++;
     if (ievent%pace == 0) {
-      cout << "# of events generated = " << ievent 
+      cout << tag << "# of events generated = " << ievent 
 	   << ", # of electrons from c/b hadron decays generated so far = " << numberOfElectrons << endl;
+      perf.wall = wallBefore + perfClock() - tStart;
+      printPerf(tag, perf);
+    }
+    if (setup.monitor && (ievent%monitorEvery == 0 || ievent%pace == 0) &&
+	updateMonitor(*setup.monitor, setup.monitorSlot, histos2D, tag, ievent%pace == 0)) {
+      cout << tag << "Stopping after " << ievent << " events: " << setup.monitor->reason << endl;
+      break;
     }
         
     // List first few events.
@@ -170,188 +820,1548 @@ int main(int argc, char* argv[]) {
       pythia.process.list();
       pythia.event.list();
     }
+
+    if (checkpointEvery > 0 && ievent%checkpointEvery == 0 && ievent < maxNumberOfEvents) {
+      t0 = perfClock();
+      loop.nAccepted = pythia.info.nAccepted();
+      loop.sigmaSum = pythia.info.sigmaGen()*loop.nAccepted;
+      countVetoes(setup.veto, vetoStart, loop);
+      stats = before;
+      stats.add(loop);
+      writeCheckpoint(pythia, histos2D, histos3D, ievent, numberOfElectrons, iErrors,
+		      saveEvents ? records.bytes() : -1, stats, checkpoint);
+      perf.seconds[perfCounters_t::kOutput] += perfClock() - t0;
+    }
   }
-    
-  //--------------------------------------------------------------
-  //  Finish up
-  //--------------------------------------------------------------
-  pythia.statistics();
-  cout << "Writing File" << endl;
-  hfile->Write();
+  records.close();
+  perf.wall = wallBefore + perfClock() - tStart;
+  loop.nAccepted = pythia.info.nAccepted();
+  loop.sigmaSum = pythia.info.sigmaGen()*loop.nAccepted;
+  countVetoes(setup.veto, vetoStart, loop);
+  stats = before;
+  stats.add(loop);
+  stats.numberOfEvents = ievent;
+  //
+  //  Effective statistics of the weighted trigger count. The passes
+  //  of one event are correlated, so the event (sum over its
+  //  passes) is the independent unit; counting the passes as
+  //  independent shows what the correlation costs.
+  //
+  if (nPasses > 1 && sumX2 > 0) {
+    char text[256];
+    sprintf(text, "Decay oversampling x%d: %.3g triggers per accepted event, n_eff = %.1f events "
+	    "(%.1f if the passes were independent)", nPasses, double(numberOfElectrons)/ievent,
+	    sumX*sumX/sumX2, sumX*sumX/sumPass2);
+    cout << tag << text << endl;
+  }
+  if (!forced.empty() || stats.sumW != stats.nAccepted)
+    cout << tag << "Sum of weights of analyzed events = " << stats.analyzedSumW << " (squares "
+	 << stats.analyzedSumW2 << "), Pythia event weights: sum = " << stats.sumW << " over "
+	 << stats.nAccepted << " events" << endl;
 
-  now = time(0);
-  cout << "============================================================================\
-" << endl;
-  cout << "Program finished at: " << ctime(&now);
-  cout << "============================================================================\
-" << endl;
-    
-  return 0;
+  //
+  //  After a resume Pythia (and pythia.statistics()) only knows the
+  //  events since then; stats covers the whole run.
+  //
+  double sigmaGen = stats.nAccepted > 0 ? stats.sigmaSum/stats.nAccepted : 0;
+  if (before.nAccepted > 0)
+    cout << tag << "Resumed run: sigmaGen = " << sigmaGen << " mb from " << stats.nAccepted
+	 << " Pythia events in total; the Pythia statistics cover the " << loop.nAccepted
+	 << " events since the resume only" << endl;
+
+  //
+  //  Pythia counts process-level vetoes as rejected events, so they
+  //  are already taken out of sigmaGen. Events vetoed at parton
+  //  level were accepted by the process level and still contribute,
+  //  hence the correction with the parton-level passing fraction.
+  //
+  if (setup.veto) {
+    double passParton = stats.nParton > 0 ? double(stats.nParton - stats.nPartonVetoed)/stats.nParton : 1;
+    cout << tag << "Veto hook: process level " << stats.nProcessVetoed << " of " << stats.nProcess
+	 << " vetoed, parton level " << stats.nPartonVetoed << " of " << stats.nParton << " vetoed" << endl;
+    cout << tag << "sigmaGen = " << sigmaGen << " mb, corrected for parton-level vetoes = "
+	 << sigmaGen*passParton << " mb" << endl;
+  }
+  return ievent;
 }
 
 //
-//  Event analysis
+//  Veto hook counts since start into stats (nothing without hook)
 //
-int myEvent(Pythia& pythia, vector<TH2D*> &histos2D, vector<TH3D*> &histos3D, double nMaxEvt)
+void countVetoes(const HeavyFlavorVeto *veto, const generatorStats_t &start, generatorStats_t &stats)
 {
-  Event &event = pythia.event;
+  if (!veto) return;
+  stats.nProcess = veto->nProcess - start.nProcess;
+  stats.nProcessVetoed = veto->nProcessVetoed - start.nProcessVetoed;
+  stats.nParton = veto->nParton - start.nParton;
+  stats.nPartonVetoed = veto->nPartonVetoed - start.nPartonVetoed;
+}
 
-  int nelectrons = 0;
-  int ic = 0;
-  int ie = 0;
-  for (int i = 0; i < event.size(); i++) {
-    if (abs(event[i].id()) == 11) { // event is electron
+//
+//  pTHat-sliced event loop. histos2D/3D hold the stitched family
+//  first and then one family per slice (bookSliceHistograms());
+//  slice k fills its own family only, with its share of the
+//  events, and sliceStats[k] returns its cross section. Each slice
+//  after the first re-initializes Pythia with its pTHat range and
+//  a seed of its own, and keeps its own checkpoint and event
+//  record (suffix _s<k>). The re-initialization forgets the Pythia
+//  statistics of the previous slice, so they are printed after
+//  each slice. Without slices this is generateEvents() on all
+//  histograms, with a single entry in sliceStats, and the caller
+//  prints the statistics.
+//
+int generateSlices(Pythia &pythia, vector<TH2D*> &histos2D, vector<TH3F*> &histos3D,
+		   int maxNumberOfEvents, int &numberOfElectrons, int &iErrors, const char* tag,
+		   const outputFiles_t &files, const generatorSetup_t &setup, perfCounters_t &perf,
+		   vector<generatorStats_t> &sliceStats)
+{
+  if (setup.pTHatBins.empty()) {
+    sliceStats.assign(1, generatorStats_t());
+    return generateEvents(pythia, histos2D, histos3D, maxNumberOfEvents, numberOfElectrons, iErrors,
+			  tag, files, setup, perf, sliceStats[0]);
+  }
 
-      //
-      //  Check if mother is a c/b hadron
-      //
-      vector<int> mothers = event.motherList(i);
-      if (mothers.size() > 1) {
-	cout << "Error: electron has more than one mother. Stop." << endl;
-	//abort();
-	return 0;
-      }
-      ic = mothers[0];
-      ie = i;
-      int ic_id = abs(event[ic].id());
-      int flavor = static_cast<int>(ic_id/pow(10.,static_cast<int>(log10(ic_id))));
-      if (flavor != 4 && flavor != 5) continue; // c (b) hadrons start with 4(5)  
+  //
+  //  The precision targets refer to histos2D<name>0, which is only
+  //  filled when the slices are stitched
+  //
+  generatorSetup_t sliceSetup = setup;
+  if (sliceSetup.monitor) {
+    cout << tag << "Warning: NPE:targetPrecision and NPE:cpuBudget are ignored with pTHat slices" << endl;
+    sliceSetup.monitor = 0;
+  }
 
+  const int nSlices = setup.pTHatBins.size() - 1;
+  const int n2 = setup.cutSets.size()*kHistos2DPerSet;
+  const int n3 = setup.cutSets.size()*kHistos3DPerSet;
+  const int baseSeed = pythia.settings.mode("Random:seed");
+  sliceStats.assign(nSlices, generatorStats_t());
+  int ievent = 0;
+  char text[64];
+  for (int k = 0; k < nSlices; k++) {
+    if (k > 0) {
+      sprintf(text, "PhaseSpace:pTHatMin = %g", setup.pTHatBins[k]);
+      pythia.readString(text);
+      sprintf(text, "PhaseSpace:pTHatMax = %g", setup.pTHatBins[k+1]);
+      pythia.readString(text);
+      pythia.readString("Random:setSeed = on");
+      sprintf(text, "Random:seed = %d", (baseSeed + 7777777*k) % 900000000);
+      pythia.readString(text);
       //
-      //  Acceptance filter
-      //    
-      if (!(isInAcceptanceE(i, event))) continue;
-            
-      nelectrons++;
-            
-      //
-      // Get grandmother (origin of c/b hadron)
-      //
-      vector<int> grandmothers = event.motherList(ic);
-      int iorig = -1;
-      switch(grandmothers.size()) {
-      case 0: 
-	iorig = -1;
-	break;
-      case 1:
-	iorig = grandmothers[0];
-	break;
-      default:
-	iorig = -2;
-	break;
-      }
-    
-           
-      // At this point we have J/psi and mother B, the J/psi detectable in
-      // STAR.
-      // We require them to be stable, i.e. not decayed.
-      // Also impose pt cut on hadrons as in data.
-      vector<int> hadrons;
-      vector<int> B_hadrons;
-      
-      for (int i = 1; i < event.size(); i++) {
-	if (event[i].isFinal() && event[i].isCharged() && event[i].pT() > 0.2 && isInAcceptanceH(i, event) && !(event[i].id()==event[ie].id())) {
-	  hadrons.push_back(i);
-	  //	  if (event.isAncestor(i, i_B)) B_hadrons.push_back(i); // From Bingchu code, save in case needed later
-	}
-      }
-      
-      //
-      //  Fill histograms                                                       
+      //  initMutex serializes this with the other threads' inits
+      //  and re-inits. Their event generation keeps running, which
+      //  is only safe because --threads refuses cards with LHAPDF
+      //  (main()); the built-in PDFs are per instance.
       //
-      
-      //histos[2]->Fill(event[i_B].pT(), 1.);                                       
-      histos2D[1]->Fill(event[ie].pT(), event[ie].y());
-      Double_t npept = event[ie].pT();
-      double phi1, phi2;
-      int nnear = 0;
-      int naway = 0;
-      double ptbalance = npept;
-      int hid;
-      double dphi=999;
-      phi1 = event[ie].phi();
-      
-      for (unsigned int i=0; i<B_hadrons.size(); i++) {
-	hid = B_hadrons[i];
-	phi2 = event[hid].phi();
-	histos2D[9]->Fill(npept, event[hid].pT());
-	histos3D[1]->Fill(npept, event[hid].pT(), deltaPhi(phi1, phi2));
-      }
-      
-      for (unsigned int i=0; i<hadrons.size(); i++) {
-	hid = hadrons[i];
-	phi2 = event[hid].phi();
-	if(!(phi1==0) && !(phi2==0))
-	  dphi = deltaPhi(phi1, phi2);
-	histos3D[0]->Fill(npept, event[hid].pT(), dphi);
-	if(event[hid].pT()<0.5) continue;
-	histos2D[0]->Fill(npept, dphi);
-	if( abs(dphi) < 1) {//near side                                                   
-	  nnear++;
-	  ptbalance += event[hid].pT();
-	  histos2D[4]->Fill(npept, event[hid].pT());
-	  histos2D[6]->Fill(npept, event[hid].m0());
-	}
-	if (abs(dphi-M_PI)<1) { //away side                                               
-	  naway++;
-	  histos2D[5]->Fill(npept, event[hid].pT());
-	  histos2D[7]->Fill(npept, event[hid].m0());
-	  ptbalance -= event[hid].pT();
-	}
-      }
-      histos2D[2]->Fill(npept, nnear);
-      histos2D[3]->Fill(npept, naway);
-      histos2D[8]->Fill(npept, ptbalance);
-      hadrons.clear();
+      pthread_mutex_lock(&initMutex);
+      pythia.init();
+      pthread_mutex_unlock(&initMutex);
     }
+    vector<TH2D*> slice2D(histos2D.begin() + (k+1)*n2, histos2D.begin() + (k+2)*n2);
+    vector<TH3F*> slice3D(histos3D.begin() + (k+1)*n3, histos3D.begin() + (k+2)*n3);
+    outputFiles_t sliceFiles = files;
+    sprintf(text, "_s%d", k);
+    sliceFiles.checkpoint += text;
+    sliceFiles.records += text;
+    int share = maxNumberOfEvents/nSlices + (k < maxNumberOfEvents%nSlices ? 1 : 0);
+    string sliceTag = tag;
+    sprintf(text, "[slice %d] ", k);
+    sliceTag += text;
+    cout << sliceTag << setup.pTHatBins[k] << " < pTHat < " << setup.pTHatBins[k+1] << ", events = " << share << endl;
+
+    int n = generateEvents(pythia, slice2D, slice3D, share, numberOfElectrons, iErrors, sliceTag.c_str(),
+			   sliceFiles, sliceSetup, perf, sliceStats[k]);
+    ievent += n;
+    pthread_mutex_lock(&coutMutex);
+    cout << sliceTag << "sigmaGen = " << (sliceStats[k].nAccepted ? sliceStats[k].sigmaSum/sliceStats[k].nAccepted : 0)
+	 << " mb from " << sliceStats[k].nAccepted << " events (sum of weights " << sliceStats[k].sumW << ")" << endl;
+    cout << sliceTag << "Pythia statistics of this slice:" << endl;
+    pythia.statistics();
+    pthread_mutex_unlock(&coutMutex);
+    if (n < share) break;   // too many errors
   }
+  return ievent;
+}
 
-  return nelectrons;
+//
+//  Slice edges "e0,e1,...,eN" in GeV/c, increasing; eN may be -1
+//  for no upper limit. "" or "void" means no slicing.
+//
+bool parsePTHatBins(const string &spec, vector<double> &edges)
+{
+  edges.clear();
+  if (spec.empty() || spec == "void") return true;
+  stringstream list(spec);
+  string item;
+  while (getline(list, item, ',')) {
+    char* end;
+    double edge = strtod(item.c_str(), &end);
+    if (end == item.c_str() || *end) return false;
+    edges.push_back(edge);
+  }
+  if (edges.size() < 2 || edges[0] < 0) return false;
+  for (unsigned int k = 1; k < edges.size(); k++) {
+    bool open = k+1 == edges.size() && edges[k] < 0;
+    if (!open && edges[k] <= edges[k-1]) return false;
+  }
+  return true;
 }
 
+//
+//  The histograms of all cut sets, followed by one such block per
+//  pTHat slice, named <name>_pth<k>_. nEdges is the number of slice
+//  edges (0 without slices).
+//
+void bookSliceHistograms(vector<TH2D*> &histos2D, vector<TH3F*> &histos3D, const char* histname,
+			 int nCutSets, int nEdges)
+{
+  bookHistograms(histos2D, histos3D, histname, nCutSets);
+  char family[128];
+  for (int k = 0; k+1 < nEdges; k++) {
+    sprintf(family, "%s_pth%d_", histname, k);
+    bookHistograms(histos2D, histos3D, family, nCutSets);
+  }
+}
 
 //
-//  Acceptance filter
+//  pTHatSlices<name> in the current directory: per slice the Pythia
+//  events, sigmaGen times those, the sum of the weights and the
+//  number of the surviving events, and the analyzed events.
+//  Merging adds them, which is what stitchSlices() expects.
 //
-bool isInAcceptanceE(int i, const Event& event)
+TH1D* writeSliceInfo(const vector<generatorStats_t> &sliceStats, const vector<double> &pTHatBins,
+		     const char* histname)
 {
-  // accept all (useful for many studies)
-  //  return true;
-    
-  // limit to STAR TPC/BEMC/ToF acceptance
-  double eta = event[i].eta();
-  if (fabs(eta) < 0.7)
-      return true;
-  else
-      return false;
+  int nSlices = pTHatBins.size() - 1;
+  char text[128];
+  sprintf(text, "pTHatSlices%s", histname);
+  TH1D *h = new TH1D(text, "pTHat slices: Pythia events, sigmaGen*events [mb], sum of weights, analyzed events, "
+		     "surviving events", kSliceInfoBins*nSlices, 0, kSliceInfoBins*nSlices);
+  const char* labels[kSliceInfoBins] = {"events", "sigma*events", "sum of weights", "analyzed", "survived"};
+  for (int k = 0; k < nSlices; k++) {
+    generatorStats_t stats;
+    if (k < static_cast<int>(sliceStats.size())) stats = sliceStats[k];
+    double values[kSliceInfoBins] = {double(stats.nAccepted), stats.sigmaSum, stats.sumW,
+				     double(stats.numberOfEvents), double(stats.nSurvived)};
+    for (int i = 0; i < kSliceInfoBins; i++) {
+      sprintf(text, "%g-%g %s", pTHatBins[k], pTHatBins[k+1], labels[i]);
+      h->GetXaxis()->SetBinLabel(kSliceInfoBins*k+i+1, text);
+      h->SetBinContent(kSliceInfoBins*k+i+1, values[i]);
+    }
+  }
+  return h;
 }
 
-bool isInAcceptanceH(int i, const Event& event)
+//
+//  eventWeights<name> in the current directory: the event and
+//  weight sums of the whole run (all slices), for normalization.
+//  The cross section per unit weight is sigmaGen/(Pythia events)
+//  times (surviving events)/(sum of weights).
+//
+void writeWeightInfo(const vector<generatorStats_t> &stats, const char* histname)
 {
-  // limit to STAR TPC/BEMC/ToF acceptance                                              
-  double eta = event[i].eta();
-  if (fabs(eta) < 1)
-    return true;
-  else
-    return false;
+  generatorStats_t total;
+  for (unsigned int k = 0; k < stats.size(); k++) total.add(stats[k]);
+  char text[128];
+  sprintf(text, "eventWeights%s", histname);
+  const int nBins = 8;
+  TH1D *h = new TH1D(text, "event and weight sums", nBins, 0, nBins);
+  const char* labels[nBins] = {"Pythia events", "sigmaGen*events [mb]", "sum of weights", "sum of weights^2",
+			       "analyzed events", "analyzed sum of weights", "analyzed sum of weights^2",
+			       "surviving events"};
+  double values[nBins] = {double(total.nAccepted), total.sigmaSum, total.sumW, total.sumW2,
+			  double(total.numberOfEvents), total.analyzedSumW, total.analyzedSumW2,
+			  double(total.nSurvived)};
+  for (int i = 0; i < nBins; i++) {
+    h->GetXaxis()->SetBinLabel(i+1, labels[i]);
+    h->SetBinContent(i+1, values[i]);
+  }
 }
 
-double deltaPhi(double phi1, double phi2)
+//
+//  Fills are weighted (and need Sumw2) with forced decays, biased
+//  phase space, pTHat slices or decay oversampling (1/K per pass)
+//
+bool weightedFills(Settings &settings)
 {
-  // move to range [0, 2pi]                                                           
-  //if (phi1<0) phi1 += 2*M_PI;
-  //if (phi2<0) phi2 += 2*M_PI;
+  return settings.flag("NPE:forceSemileptonic") || settings.flag("PhaseSpace:bias2Selection") ||
+    settings.word("NPE:pTHatBins") != "void" || settings.mode("NPE:decayOversample") > 1;
+}
 
-  // correct difference                                                               
-  double delta = phi2-phi1;
-  if (delta < -M_PI) delta += 2*M_PI;
-  if (delta > M_PI) delta -= 2*M_PI;
+//
+//  Fills the first block of histograms (the usual names) with the
+//  sum of the slices, each weighted by its cross section per
+//  Pythia event weight. sigmaGen/nAccepted is the cross section
+//  per Pythia event, vetoed ones included; the filled events are
+//  the nSurvived that were not vetoed, with weights summing to
+//  sumW, hence sigmaGen/nAccepted * nSurvived/sumW. Without bias
+//  this is sigmaGen/nAccepted. The stitched templates are thus in
+//  mb.
+//
+void stitchSlices(vector<TH2D*> &histos2D, vector<TH3F*> &histos3D, int nCutSets, const TH1D *sliceInfo)
+{
+  const int n2 = nCutSets*kHistos2DPerSet;
+  const int n3 = nCutSets*kHistos3DPerSet;
+  const int nSlices = histos2D.size()/n2 - 1;
+  for (int i = 0; i < n2; i++) histos2D[i]->Reset();
+  for (int i = 0; i < n3; i++) histos3D[i]->Reset();
+  for (int k = 0; k < nSlices; k++) {
+    const int bin = kSliceInfoBins*k + 1;
+    double nAccepted = sliceInfo->GetBinContent(bin);
+    double sumW = sliceInfo->GetBinContent(bin+2);
+    double nSurvived = sliceInfo->GetBinContent(bin+4);
+    if (nAccepted <= 0 || sumW <= 0) {
+      cout << "Warning: pTHat slice " << k << " has no events, left out" << endl;
+      continue;
+    }
+    double sigma = sliceInfo->GetBinContent(bin+1)/nAccepted;
+    double weight = sigma*nSurvived/sumW;
+    cout << "pTHat slice " << k << ": sigmaGen = " << sigma << " mb, " << nAccepted
+	 << " events, weight = " << weight << " mb/event" << endl;
+    for (int i = 0; i < n2; i++) histos2D[i]->Add(histos2D[(k+1)*n2 + i], weight);
+    for (int i = 0; i < n3; i++) histos3D[i]->Add(histos3D[(k+1)*n3 + i], weight);
+  }
+}
 
-  return delta;
+//
+//  Stitching of a merged file (--fork, --campaign): the parts only
+//  carry the slices and their pTHatSlices<name>; the stitched
+//  histograms are overwritten in place.
+//
+bool stitchSlicesInFile(const char* rootfile, const char* histname, int nCutSets, int nEdges)
+{
+  TDirectory *saveDir = gDirectory;
+  TFile *file = TFile::Open(rootfile, "UPDATE");
+  if (!file || file->IsZombie()) {
+    cout << "Error: cannot open '" << rootfile << "' to stitch the pTHat slices" << endl;
+    delete file;
+    saveDir->cd();
+    return false;
+  }
+  char text[128];
+  sprintf(text, "pTHatSlices%s", histname);
+  TH1D *sliceInfo = static_cast<TH1D*>(file->Get(text));
+  vector<TH2D*> histos2D;
+  vector<TH3F*> histos3D;
+  bool ok = sliceInfo != 0;
+  if (ok) {
+    bookSliceHistograms(histos2D, histos3D, histname, nCutSets, nEdges);
+    enableWeights(histos2D, histos3D);
+    for (unsigned int k = 0; k < histos2D.size(); k++) {
+      histos2D[k]->SetDirectory(0);
+      TH2D *h = static_cast<TH2D*>(file->Get(histos2D[k]->GetName()));
+      if (h) histos2D[k]->Add(h);
+      else ok = false;
+      delete h;
+    }
+    for (unsigned int k = 0; k < histos3D.size(); k++) {
+      histos3D[k]->SetDirectory(0);
+      TH3F *h = static_cast<TH3F*>(file->Get(histos3D[k]->GetName()));
+      if (h) histos3D[k]->Add(h);
+      else ok = false;
+      delete h;
+    }
+  }
+  if (ok) {
+    stitchSlices(histos2D, histos3D, nCutSets, sliceInfo);
+    file->cd();
+    for (int k = 0; k < nCutSets*kHistos2DPerSet; k++) histos2D[k]->Write(0, TObject::kOverwrite);
+    for (int k = 0; k < nCutSets*kHistos3DPerSet; k++) histos3D[k]->Write(0, TObject::kOverwrite);
+  }
+  else cout << "Error: '" << rootfile << "' lacks pTHat slice histograms, not stitched" << endl;
+  for (unsigned int k = 0; k < histos2D.size(); k++) delete histos2D[k];
+  for (unsigned int k = 0; k < histos3D.size(); k++) delete histos3D[k];
+  file->Close();
+  delete file;
+  saveDir->cd();
+  return ok;
 }
 
-double deltaEta(double e1, double e2)
+//
+//  Prepare the forced decays. A channel of a c/b hadron is kept
+//  if it contains an electron or leads on to one: a c/b quark or
+//  a c/b hadron that itself has a kept channel (B->D->e, D*->D,
+//  B*->B). Channels without either are switched off while the
+//  hadron is forced; the fraction of the original BR that stays
+//  on is its weight. All c/b hadrons are kept undecayed by Pythia
+//  so that forceTriggerChain() decides which one is forced.
+//
+void forceSemileptonicDecays(ParticleData &particleData, forcedDecays_t &forced)
 {
-  double delta = e2-e1;
-  return delta;
+  for (int id = particleData.nextId(0); id != 0; id = particleData.nextId(id)) {
+    if (id < 100 || id > 10000) continue;
+    int flavor = hfFlavor(id);
+    if (flavor != 4 && flavor != 5) continue;
+    if (particleData.particleDataEntryPtr(id)->decay.size() > 0) forced.ids.insert(id);
+  }
+
+  //
+  //  Hadrons that reach an electron, iterated until nothing changes
+  //  since a B channel depends on its D products
+  //
+  set<int> reach;
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (set<int>::const_iterator it = forced.ids.begin(); it != forced.ids.end(); ++it) {
+      if (reach.count(*it)) continue;
+      DecayTable &decays = particleData.particleDataEntryPtr(*it)->decay;
+      for (int i = 0; i < decays.size() && !reach.count(*it); i++) {
+	if (decays[i].onMode() <= 0) continue;
+	for (int j = 0; j < decays[i].multiplicity(); j++) {
+	  int product = abs(decays[i].product(j));
+	  if (product == 11 || product == 4 || product == 5 || reach.count(product)) {
+	    reach.insert(*it);
+	    changed = true;
+	    break;
+	  }
+	}
+      }
+    }
+  }
+
+  for (set<int>::const_iterator it = forced.ids.begin(); it != forced.ids.end(); ++it) {
+    DecayTable &decays = particleData.particleDataEntryPtr(*it)->decay;
+    double total = 0;
+    double kept = 0;
+    vector<int> off;
+    for (int i = 0; i < decays.size(); i++) {
+      if (decays[i].onMode() <= 0) continue;
+      total += decays[i].bRatio();
+      bool keep = false;
+      for (int j = 0; j < decays[i].multiplicity(); j++) {
+	int product = abs(decays[i].product(j));
+	keep |= product == 11 || product == 4 || product == 5 || reach.count(product) > 0;
+      }
+      if (keep) kept += decays[i].bRatio();
+      else off.push_back(i);
+    }
+    if (kept > 0 && kept < total) {
+      forced.offChannels[*it] = off;
+      forced.keptFraction[*it] = kept/total;
+    }
+    particleData.mayDecay(*it, false);
+  }
+}
+
+//
+//  Force the decay chain of one c/b hadron of the event into an
+//  electron and decay everything else as Pythia would. The hadron
+//  is one of the n undecayed c/b hadrons, chosen at random (weight
+//  times n), so the other hadrons, and with them the away side,
+//  keep their natural decays. It is decayed with the off channels
+//  switched off (weight times the kept BR fraction); a mixed B0 is
+//  followed to its oscillated copy, whose decay is the one that
+//  counts. If the decay has c/b hadrons, one of them is forced
+//  next (weight times their number); if it has both an electron
+//  and c/b hadrons, either its electrons are the triggers or the
+//  chain goes on, at random (weight times 2). Each electron of the
+//  hadron's natural decay tree is thus reached by exactly one
+//  sequence of choices, and the weight makes up for their
+//  probability. Returns the hadron whose electrons are the
+//  triggers (0 if none); weight is multiplied accordingly.
+//
+int forceTriggerChain(Pythia &pythia, const forcedDecays_t &forced, double &weight)
+{
+  Event &event = pythia.event;
+  ParticleData &particleData = pythia.particleData;
+
+  vector<int> candidates;
+  for (int i = 1; i < event.size(); i++)
+    if (event[i].isFinal() && forced.ids.count(abs(event[i].id()))) candidates.push_back(i);
+
+  int triggerParent = 0;
+  int h = 0;
+  if (!candidates.empty()) {
+    h = candidates[min(int(pythia.rndm.flat()*candidates.size()), int(candidates.size())-1)];
+    weight *= candidates.size();
+  }
+  while (h > 0) {
+    int id = abs(event[h].id());
+
+    //
+    //  Decay h alone: the other c/b hadrons are hidden, those of
+    //  its own species would decay along otherwise
+    //
+    vector<int> hidden;
+    for (int i = 1; i < event.size(); i++) {
+      if (i == h || !event[i].isFinal() || !forced.ids.count(abs(event[i].id()))) continue;
+      event[i].status(-event[i].status());
+      hidden.push_back(i);
+    }
+    DecayTable &decays = particleData.particleDataEntryPtr(id)->decay;
+    map<int, vector<int> >::const_iterator off = forced.offChannels.find(id);
+    vector<int> modes;
+    if (off != forced.offChannels.end()) {
+      for (unsigned int k = 0; k < off->second.size(); k++) {
+	modes.push_back(decays[off->second[k]].onMode());
+	decays[off->second[k]].onMode(0);
+      }
+      weight *= forced.keptFraction.find(id)->second;
+    }
+    int first = event.size();
+    particleData.mayDecay(id, true);
+    bool ok = pythia.moreDecays();
+    particleData.mayDecay(id, false);
+    if (off != forced.offChannels.end())
+      for (unsigned int k = 0; k < off->second.size(); k++) decays[off->second[k]].onMode(modes[k]);
+    for (unsigned int k = 0; k < hidden.size(); k++) event[hidden[k]].status(-event[hidden[k]].status());
+    if (!ok) break;
+
+    int parent = h;
+    int d = event[h].daughter1();
+    if (d >= first && d == event[h].daughter2() && abs(event[d].id()) == id) parent = d;   // B0 mixing
+
+    bool electron = false;
+    vector<int> next;
+    for (int i = first; i < event.size(); i++) {
+      if (abs(event[i].id()) == 11 && event[i].mother1() == parent) electron = true;
+      if (event[i].isFinal() && forced.ids.count(abs(event[i].id()))) next.push_back(i);
+    }
+    if (electron && !next.empty()) {
+      weight *= 2;
+      if (pythia.rndm.flat() < 0.5) next.clear();
+    }
+    if (next.empty()) {
+      if (electron) triggerParent = parent;
+      break;
+    }
+    h = next[min(int(pythia.rndm.flat()*next.size()), int(next.size())-1)];
+    weight *= next.size();
+  }
+
+  //
+  //  The rest decays naturally
+  //
+  for (set<int>::const_iterator it = forced.ids.begin(); it != forced.ids.end(); ++it)
+    particleData.mayDecay(*it, true);
+  pythia.moreDecays();
+  for (set<int>::const_iterator it = forced.ids.begin(); it != forced.ids.end(); ++it)
+    particleData.mayDecay(*it, false);
+  return triggerParent;
+}
+
+//
+//  Thread body for --threads mode
+//
+void* generatorThread(void* arg)
+{
+  generatorJob_t &job = *static_cast<generatorJob_t*>(arg);
+  char tag[32];
+  sprintf(tag, "[thread %d] ", job.ithread);
+
+  pthread_mutex_lock(&initMutex);
+  double cpu = threadCpuSeconds();
+  Pythia* pythia = new Pythia(job.xmlDB);
+  generatorSetup_t setup;
+  setupPythia(*pythia, job.runcard, job.seed, job.ithread == 0, setup);
+  pthread_mutex_unlock(&initMutex);
+  if (job.monitor) {
+    // the inits are not generation, keep them out of NPE:cpuBudget
+    pthread_mutex_lock(&job.monitor->mutex);
+    job.monitor->cpuInit += threadCpuSeconds() - cpu;
+    pthread_mutex_unlock(&job.monitor->mutex);
+  }
+  setup.monitor = job.monitor;
+  setup.monitorSlot = job.ithread;
+  cout << tag << "seed = " << job.seed << ", events = " << job.maxNumberOfEvents << endl;
+
+  job.numberOfElectrons = 0;
+  job.iErrors = 0;
+  job.numberOfEvents = generateSlices(*pythia, job.histos2D, job.histos3D, job.maxNumberOfEvents,
+				      job.numberOfElectrons, job.iErrors, tag, job.files, setup, job.perf,
+				      job.sliceStats);
+
+  if (setup.pTHatBins.empty()) {   // per slice in generateSlices()
+    pthread_mutex_lock(&coutMutex);
+    pythia->statistics();
+    pthread_mutex_unlock(&coutMutex);
+  }
+  delete pythia;
+  delete setup.veto;
+  return 0;
+}
+
+//
+//  --campaign: one run per seed in [firstSeed, lastSeed], each a
+//  forked process that runs the runcard with that seed and writes
+//  <rootfile>_<seed>.root and a log <rootfile>_<seed>.log (rootfile
+//  without .root). Up to nJobs run at a time; a new seed is started
+//  as soon as one finishes. Seeds start at 1, since Pythia takes
+//  seed 0 from the clock. A run that fails (crash, too many
+//  errors) is retried up to twice, from its checkpoint if
+//  NPE:checkpointEvery is set. The retry runs the same seed, so a
+//  failure that repeats with the same exit status or signal is
+//  deterministic and the seed is given up at once; only a kill
+//  (SIGKILL, SIGTERM: eviction, out of memory) is always retried.
+//  The parts are merged into rootfile at the end. Returns the exit
+//  status of the program.
+//
+int runCampaign(const char* runcard, const char* rootfile, const char* histname, const char* xmlDB,
+		int firstSeed, int lastSeed, int nJobs)
+{
+  const int maxAttempts = 3;
+  string base = rootfile;
+  if (base.size() > 5 && base.compare(base.size()-5, 5, ".root") == 0) base.erase(base.size()-5);
+
+  deque<int> pending;
+  for (int seed = firstSeed; seed <= lastSeed; seed++) pending.push_back(seed);
+  map<pid_t,int> running;     // pid -> seed
+  map<int,int> attempts;
+  map<int,int> lastFailure;   // seed -> wait status of its last failed attempt
+  vector<string> parts;
+  vector<int> failed;
+  char text[32];
+
+  while (!pending.empty() || !running.empty()) {
+    while (!pending.empty() && static_cast<int>(running.size()) < nJobs) {
+      int seed = pending.front();
+      sprintf(text, "_%d", seed);
+      cout.flush();
+      pid_t pid = fork();
+      if (pid == 0) _exit(campaignWorker(runcard, base + text, histname, xmlDB, seed));
+      if (pid < 0) {
+	cout << "Error: cannot fork a worker for seed " << seed << endl;
+	if (running.empty()) return 1;
+	break;
+      }
+      pending.pop_front();
+      running[pid] = seed;
+      attempts[seed]++;
+      cout << "Seed " << seed << " started (pid " << pid << ", attempt " << attempts[seed] << ")" << endl;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) break;
+    map<pid_t,int>::iterator it = running.find(pid);
+    if (it == running.end()) continue;
+    int seed = it->second;
+    running.erase(it);
+    sprintf(text, "_%d", seed);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      parts.push_back(base + text + ".root");
+      cout << "Seed " << seed << " done, " << parts.size() << " of " << lastSeed-firstSeed+1 << endl;
+    }
+    else {
+      bool killed = WIFSIGNALED(status) && (WTERMSIG(status) == SIGKILL || WTERMSIG(status) == SIGTERM);
+      bool repeated = !killed && lastFailure.count(seed) && lastFailure[seed] == status;
+      lastFailure[seed] = status;
+      char how[64];
+      if (WIFSIGNALED(status)) sprintf(how, "signal %d", WTERMSIG(status));
+      else sprintf(how, "exit status %d", WEXITSTATUS(status));
+      if (repeated) {
+	cout << "Seed " << seed << " failed again with " << how << " (see " << base + text
+	     << ".log), the failure is deterministic, giving up" << endl;
+	failed.push_back(seed);
+      }
+      else if (attempts[seed] < maxAttempts) {
+	cout << "Seed " << seed << " failed with " << how << " (see " << base + text << ".log), retrying" << endl;
+	pending.push_back(seed);
+      }
+      else {
+	cout << "Seed " << seed << " failed " << maxAttempts << " times, giving up" << endl;
+	failed.push_back(seed);
+      }
+    }
+  }
+
+  if (parts.empty()) {
+    cout << "Error: no run of the campaign succeeded" << endl;
+    return 1;
+  }
+  cout << "Merging " << parts.size() << " parts into '" << rootfile << "'" << endl;
+  vector<string> merged;
+  int nMerged = mergeHistogramFiles(parts, rootfile, nJobs, &merged);
+  if (nMerged < 0) {
+    cout << "Error: merging failed, the parts are kept" << endl;
+    return 1;
+  }
+  for (unsigned int k = 0; k < merged.size(); k++) unlink(merged[k].c_str());
+  vector<double> pTHatBins;
+  vector<cutSet_t> cutSets;
+  if (parsePTHatBins(cardValue(runcard, "NPE:pTHatBins"), pTHatBins) && !pTHatBins.empty() &&
+      parseCutSets(cardValue(runcard, "NPE:cutSets"), cutSets) &&
+      !stitchSlicesInFile(rootfile, histname, cutSets.size(), pTHatBins.size())) return 1;
+  if (!failed.empty() || nMerged != static_cast<int>(parts.size())) {
+    cout << "Warning: " << failed.size() << " seeds failed, " << parts.size()-nMerged
+	 << " parts could not be merged" << endl;
+    return 3;
+  }
+  return 0;
+}
+
+//
+//  --fork: Pythia is set up and initialized once (xmldoc, runcard,
+//  LHAPDF grid, init()) and then nForks processes are forked from
+//  it. They share the initialized state copy-on-write; each one
+//  only reseeds its random number generator (seeds as for
+//  --threads), generates its share of the events into
+//  <rootfile>_f<i>.root and exits. The parts are merged into
+//  rootfile. Checkpoints work per worker as usual.
+//
+int runForked(const char* runcard, const char* rootfile, const char* histname, const char* xmlDB, int nForks)
+{
+  string base = rootfile;
+  if (base.size() > 5 && base.compare(base.size()-5, 5, ".root") == 0) base.erase(base.size()-5);
+
+  Pythia pythia(xmlDB);
+  generatorSetup_t setup;
+  setupPythia(pythia, runcard, -1, true, setup);
+  int maxNumberOfEvents = pythia.settings.mode("Main:numberOfEvents");
+  int baseSeed = pythia.settings.mode("Random:seed");
+
+  //
+  //  The workers cannot see each other's histograms. Each one
+  //  aims at sqrt(nForks) times the relative error and gets its
+  //  share of the CPU budget, which together gives the targets.
+  //
+  stoppingMonitor_t monitor;
+  if (initMonitor(monitor, pythia.settings, 1, sqrt(double(nForks)), 1./nForks)) setup.monitor = &monitor;
+
+  vector<string> parts;
+  vector<pid_t> pids;
+  char text[32];
+  for (int iw = 0; iw < nForks; iw++) {
+    sprintf(text, "_f%d.root", iw);
+    parts.push_back(base + text);
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+      cout << "Error: cannot fork worker " << iw << endl;
+      parts.pop_back();
+      break;
+    }
+    if (pid > 0) {
+      pids.push_back(pid);
+      continue;
+    }
+
+    //
+    //  Worker
+    //
+    int seed = (baseSeed + 1000003*iw) % 900000000;
+    int nEvents = maxNumberOfEvents/nForks + (iw < maxNumberOfEvents%nForks ? 1 : 0);
+    pythia.rndm.init(seed);
+    sprintf(text, "Random:seed = %d", seed);   // for the re-initialization of pTHat slices
+    pythia.readString(text);
+    if (setup.monitor) monitor.cpuStart = cpuSeconds();   // the child's CPU clock restarts
+    char tag[32];
+    sprintf(tag, "[worker %d] ", iw);
+    cout << tag << "seed = " << seed << ", events = " << nEvents << endl;
+
+    TFile *hfile = new TFile(parts.back().c_str(), "RECREATE");
+    vector<TH2D*> histos2D;
+    vector<TH3F*> histos3D;
+    bookSliceHistograms(histos2D, histos3D, histname, setup.cutSets.size(), setup.pTHatBins.size());
+    if (weightedFills(pythia.settings)) enableWeights(histos2D, histos3D);
+    int numberOfElectrons = 0;
+    int iErrors = 0;
+    outputFiles_t files = outputFileNames(parts.back().c_str(), -1);
+    perfCounters_t perf;
+    vector<generatorStats_t> sliceStats;
+    int ievent = generateSlices(pythia, histos2D, histos3D, nEvents, numberOfElectrons, iErrors,
+				tag, files, setup, perf, sliceStats);
+    cout << tag << "# of events generated = " << ievent
+	 << ", # of electrons from c/b hadron decays = " << numberOfElectrons
+	 << ", # of errors = " << iErrors << endl;
+    if (setup.pTHatBins.empty()) pythia.statistics();   // per slice in generateSlices()
+    printPerf(tag, perf);
+    writePerfSummary(perf, histname);
+    writeWeightInfo(sliceStats, histname);
+    if (!setup.pTHatBins.empty()) writeSliceInfo(sliceStats, setup.pTHatBins, histname);
+    hfile->Write();
+    hfile->Close();
+    removeCheckpoint(files.checkpoint);
+    cout.flush();
+    _exit(ievent < nEvents && !(setup.monitor && monitor.done) ? 1 : 0);
+  }
+
+  //
+  //  Failed workers' parts are left out of the merge but kept on
+  //  disk (with their checkpoints) for inspection or a rerun
+  //
+  bool ok = static_cast<int>(pids.size()) == nForks;
+  vector<string> good;
+  for (unsigned int iw = 0; iw < pids.size(); iw++) {
+    int status;
+    if (waitpid(pids[iw], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      cout << "Error: worker " << iw << " failed, its part '" << parts[iw] << "' is left out and kept" << endl;
+      ok = false;
+    }
+    else good.push_back(parts[iw]);
+  }
+  parts = good;
+  delete setup.veto;
+  if (parts.empty()) {
+    cout << "Error: no worker succeeded" << endl;
+    return 1;
+  }
+
+  cout << "Merging " << parts.size() << " parts into '" << rootfile << "'" << endl;
+  vector<string> merged;
+  int nMerged = mergeHistogramFiles(parts, rootfile, 1, &merged);
+  if (nMerged < 0) {
+    cout << "Error: merging failed, the parts are kept" << endl;
+    return 1;
+  }
+  for (unsigned int k = 0; k < merged.size(); k++) unlink(merged[k].c_str());
+  if (!setup.pTHatBins.empty() &&
+      !stitchSlicesInFile(rootfile, histname, setup.cutSets.size(), setup.pTHatBins.size())) return 1;
+  return ok && nMerged == static_cast<int>(parts.size()) ? 0 : 3;
+}
+
+//
+//  Body of one campaign run (in the forked process). Output goes
+//  to <base>.log. Returns 0 if all events were generated.
+//
+int campaignWorker(const char* runcard, const string &base, const char* histname, const char* xmlDB, int seed)
+{
+  if (!freopen((base + ".log").c_str(), "a", stdout)) return 1;
+  dup2(fileno(stdout), fileno(stderr));
+  string rootfile = base + ".root";
+
+  TFile *hfile = new TFile(rootfile.c_str(), "RECREATE");
+  vector<TH2D*> histos2D;
+  vector<TH3F*> histos3D;
+  Pythia pythia(xmlDB);
+  generatorSetup_t setup;
+  setupPythia(pythia, runcard, seed, true, setup);
+  int maxNumberOfEvents = pythia.settings.mode("Main:numberOfEvents");
+  bookSliceHistograms(histos2D, histos3D, histname, setup.cutSets.size(), setup.pTHatBins.size());
+  if (weightedFills(pythia.settings)) enableWeights(histos2D, histos3D);
+  stoppingMonitor_t monitor;
+  if (initMonitor(monitor, pythia.settings, 1, 1, 1)) setup.monitor = &monitor;
+  int numberOfElectrons = 0;
+  int iErrors = 0;
+  outputFiles_t files = outputFileNames(rootfile.c_str(), -1);
+  perfCounters_t perf;
+  vector<generatorStats_t> sliceStats;
+  int ievent = generateSlices(pythia, histos2D, histos3D, maxNumberOfEvents,
+			      numberOfElectrons, iErrors, "", files, setup, perf, sliceStats);
+  if (setup.pTHatBins.empty()) pythia.statistics();   // per slice in generateSlices()
+  delete setup.veto;
+  if (ievent < maxNumberOfEvents && !(setup.monitor && monitor.done)) {
+    cout << "Error: only " << ievent << " of " << maxNumberOfEvents << " events generated" << endl;
+    cout.flush();
+    return 1;
+  }
+  printPerf("", perf);
+  writePerfSummary(perf, histname);
+  writeWeightInfo(sliceStats, histname);
+  if (!setup.pTHatBins.empty()) writeSliceInfo(sliceStats, setup.pTHatBins, histname);
+  hfile->Write();
+  hfile->Close();
+  removeCheckpoint(files.checkpoint);
+  cout.flush();
+  return 0;
+}
+
+//
+//  Value of a setting in the runcard, read without Pythia ("" if
+//  absent). Names are case-insensitive as in Pythia; the last
+//  occurrence wins.
+//
+string cardValue(const char* runcard, const char* name)
+{
+  ifstream card(runcard);
+  string line;
+  string value;
+  while (getline(card, line)) {
+    size_t eq = line.find('=');
+    if (eq == string::npos) continue;
+    string key;
+    istringstream keyStream(line.substr(0, eq));
+    keyStream >> key;
+    if (strcasecmp(key.c_str(), name)) continue;
+    istringstream valueStream(line.substr(eq+1));
+    value.clear();
+    valueStream >> value;
+  }
+  return value;
+}
+
+//
+//  Start-up of many short jobs is dominated by reading the Pythia
+//  xmldoc and the LHAPDF grid from the shared file system. With
+//  NPE:initCacheDir = <dir> the first job on a node copies both
+//  into <dir>/npeh-<key>, and later jobs read the local copy. The
+//  key is a hash of the xmldoc path, the PDF set name and the size
+//  and date of the originals, so an updated installation gets a
+//  new cache. The copy is made under a temporary name and renamed,
+//  so jobs starting together do not see half a cache. Returns the
+//  xmldoc directory to use and points LHAPATH to the cached grid.
+//
+//  Pythia 8.1 cannot save its state after init(), so init() itself
+//  still runs in every job; --fork shares it between processes.
+//
+string prepareInitCache(const char* runcard, const char* xmlDB, const char* pdfSets)
+{
+  string cacheDir = cardValue(runcard, "NPE:initCacheDir");
+  if (cacheDir.empty() || cacheDir == "void") return xmlDB;
+
+  string pdfSet;
+  if (strcasecmp(cardValue(runcard, "PDF:useLHAPDF").c_str(), "on") == 0)
+    pdfSet = cardValue(runcard, "PDF:LHAPDFset");
+  string pdfDir = getenv("LHAPATH") ? getenv("LHAPATH") : pdfSets;
+  string pdfFile = pdfDir + "/" + pdfSet;
+
+  //
+  //  FNV-1a over what determines the cache content
+  //
+  struct stat stXml, stPdf;
+  memset(&stPdf, 0, sizeof(stPdf));
+  if (stat((string(xmlDB) + "/ParticleData.xml").c_str(), &stXml) ||
+      (!pdfSet.empty() && stat(pdfFile.c_str(), &stPdf))) {
+    cout << "Warning: cannot find xmldoc or PDF set '" << pdfFile << "', init cache not used" << endl;
+    return xmlDB;
+  }
+  ostringstream id;
+  id << xmlDB << "|" << stXml.st_size << "|" << stXml.st_mtime << "|" << pdfFile
+     << "|" << stPdf.st_size << "|" << stPdf.st_mtime;
+  unsigned long long hash = 14695981039346656037ULL;
+  string text = id.str();
+  for (unsigned int i = 0; i < text.size(); i++) {
+    hash ^= static_cast<unsigned char>(text[i]);
+    hash *= 1099511628211ULL;
+  }
+  char key[32];
+  sprintf(key, "npeh-%016llx", hash);
+  string cache = cacheDir + "/" + key;
+
+  if (access((cache + "/xmldoc/ParticleData.xml").c_str(), R_OK)) {
+    char tmp[32];
+    sprintf(tmp, ".tmp%d", static_cast<int>(getpid()));
+    string work = cache + tmp;
+    cout << "Filling init cache '" << cache << "'" << endl;
+    bool ok = makeDirectories(work + "/PDFsets") && copyDirectory(xmlDB, work + "/xmldoc");
+    if (ok && !pdfSet.empty()) ok = copyFile(pdfFile, work + "/PDFsets/" + pdfSet);
+    if (!ok || rename(work.c_str(), cache.c_str())) {
+      // failed, or another job was faster
+      removeDirectory(work);
+      if (access((cache + "/xmldoc/ParticleData.xml").c_str(), R_OK)) {
+	cout << "Warning: cannot fill init cache '" << cache << "', using the originals" << endl;
+	return xmlDB;
+      }
+    }
+  }
+  cout << "Using init cache '" << cache << "'" << endl;
+  if (!pdfSet.empty()) setenv("LHAPATH", (cache + "/PDFsets").c_str(), 1);
+  return cache + "/xmldoc";
+}
+
+//
+//  File system helpers for the init cache (mkdir -p, cp -p, cp -pR
+//  and rm -rf without a shell)
+//
+bool makeDirectories(const string &path)
+{
+  for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos+1)) {
+    string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) return false;
+    if (pos == string::npos) return true;
+  }
+}
+
+bool copyFile(const string &from, const string &to)
+{
+  struct stat st;
+  FILE *in = fopen(from.c_str(), "rb");
+  if (!in) return false;
+  FILE *out = fopen(to.c_str(), "wb");
+  if (!out) {
+    fclose(in);
+    return false;
+  }
+  char buffer[65536];
+  size_t n;
+  bool ok = true;
+  while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) ok = fwrite(buffer, 1, n, out) == n;
+  ok = ok && !ferror(in);
+  fclose(in);
+  ok = fclose(out) == 0 && ok;
+  if (ok && !stat(from.c_str(), &st)) chmod(to.c_str(), st.st_mode & 07777);
+  return ok;
+}
+
+bool copyDirectory(const string &from, const string &to)
+{
+  DIR *dir = opendir(from.c_str());
+  if (!dir) return false;
+  bool ok = !mkdir(to.c_str(), 0755) || errno == EEXIST;
+  struct dirent *entry;
+  while (ok && (entry = readdir(dir))) {
+    string name = entry->d_name;
+    if (name == "." || name == "..") continue;
+    struct stat st;
+    string source = from + "/" + name;
+    if (stat(source.c_str(), &st)) ok = false;
+    else if (S_ISDIR(st.st_mode)) ok = copyDirectory(source, to + "/" + name);
+    else ok = copyFile(source, to + "/" + name);
+  }
+  closedir(dir);
+  return ok;
+}
+
+void removeDirectory(const string &path)
+{
+  DIR *dir = opendir(path.c_str());
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      string name = entry->d_name;
+      if (name == "." || name == "..") continue;
+      string child = path + "/" + name;
+      struct stat st;
+      if (!lstat(child.c_str(), &st) && S_ISDIR(st.st_mode)) removeDirectory(child);
+      else unlink(child.c_str());
+    }
+    closedir(dir);
+  }
+  rmdir(path.c_str());
+}
+
+//
+//  Checkpointing. A checkpoint is a ROOT file with the histograms,
+//  the loop counters and the Pythia random number state, all in
+//  one file. It is written under a temporary name and then renamed,
+//  so an eviction while writing leaves the previous checkpoint
+//  intact and histograms and random numbers always match. If events
+//  are saved, the checkpoint also holds the size of the event
+//  record file at that point; on resume the record is cut back to
+//  it.
+//
+outputFiles_t outputFileNames(const char* rootfile, int ithread)
+{
+  char text[32] = "";
+  if (ithread >= 0) sprintf(text, "_t%d", ithread);
+  outputFiles_t files;
+  files.checkpoint = string(rootfile) + ".ckpt" + text;
+  files.records = string(rootfile) + ".npeev" + text;
+  return files;
+}
+
+void writeCheckpoint(Pythia &pythia, vector<TH2D*> &histos2D, vector<TH3F*> &histos3D,
+		     int ievent, int numberOfElectrons, int iErrors, long recordBytes,
+		     const generatorStats_t &stats, const string &checkpoint)
+{
+  string tmp = checkpoint + ".tmp";
+  string state;
+  if (!rndmStateToText(pythia, tmp, state)) {
+    cout << "Error: cannot write random number state for checkpoint '" << checkpoint << "'" << endl;
+    return;
+  }
+
+  char text[512];
+  pthread_mutex_lock(&rootIOMutex);
+  TDirectory *saveDir = gDirectory;
+  TFile *cfile = new TFile(tmp.c_str(), "RECREATE");
+  sprintf(text, "%d %d %d %ld %ld %.17g %.17g %.17g %.17g %.17g %ld %ld %ld %ld %ld", ievent, numberOfElectrons,
+	  iErrors, recordBytes, stats.nAccepted, stats.sigmaSum, stats.sumW, stats.sumW2,
+	  stats.analyzedSumW, stats.analyzedSumW2, stats.nProcess, stats.nProcessVetoed,
+	  stats.nParton, stats.nPartonVetoed, stats.nSurvived);
+  TNamed counters("counters", text);
+  counters.Write();
+  TNamed rndm("rndm", state.c_str());
+  rndm.Write();
+  for (unsigned int k = 0; k < histos2D.size(); k++) histos2D[k]->Write();
+  for (unsigned int k = 0; k < histos3D.size(); k++) histos3D[k]->Write();
+  cfile->Close();
+  delete cfile;
+  saveDir->cd();
+  pthread_mutex_unlock(&rootIOMutex);
+
+  rename(tmp.c_str(), checkpoint.c_str());
+}
+
+bool readCheckpoint(Pythia &pythia, vector<TH2D*> &histos2D, vector<TH3F*> &histos3D,
+		    int &ievent, int &numberOfElectrons, int &iErrors, long &recordBytes,
+		    generatorStats_t &stats, const string &checkpoint)
+{
+  if (access(checkpoint.c_str(), R_OK)) return false;
+
+  bool ok = false;
+  string state;
+  pthread_mutex_lock(&rootIOMutex);
+  TDirectory *saveDir = gDirectory;
+  TFile *cfile = new TFile(checkpoint.c_str(), "READ");
+  TNamed *counters = cfile->IsZombie() ? 0 : static_cast<TNamed*>(cfile->Get("counters"));
+  TNamed *rndm = cfile->IsZombie() ? 0 : static_cast<TNamed*>(cfile->Get("rndm"));
+  if (rndm) state = rndm->GetTitle();
+  recordBytes = -1;
+  stats = generatorStats_t();
+  if (counters && rndm &&
+      sscanf(counters->GetTitle(), "%d %d %d %ld %ld %lg %lg %lg %lg %lg %ld %ld %ld %ld %ld", &ievent,
+	     &numberOfElectrons, &iErrors, &recordBytes, &stats.nAccepted, &stats.sigmaSum, &stats.sumW,
+	     &stats.sumW2, &stats.analyzedSumW, &stats.analyzedSumW2, &stats.nProcess, &stats.nProcessVetoed,
+	     &stats.nParton, &stats.nPartonVetoed, &stats.nSurvived) >= 3) {
+    ok = true;
+    for (unsigned int k = 0; ok && k < histos2D.size(); k++) {
+      TH2D *h = static_cast<TH2D*>(cfile->Get(histos2D[k]->GetName()));
+      if (h) histos2D[k]->Add(h);
+      else ok = false;
+    }
+    for (unsigned int k = 0; ok && k < histos3D.size(); k++) {
+      TH3F *h = static_cast<TH3F*>(cfile->Get(histos3D[k]->GetName()));
+      if (h) histos3D[k]->Add(h);
+      else ok = false;
+    }
+  }
+  cfile->Close();
+  delete cfile;
+  saveDir->cd();
+  pthread_mutex_unlock(&rootIOMutex);
+
+  if (ok) ok = rndmStateFromText(pythia, checkpoint + ".tmp", state);
+  if (!ok) {
+    cout << "Error: checkpoint '" << checkpoint << "' is unusable, starting from scratch" << endl;
+    for (unsigned int k = 0; k < histos2D.size(); k++) histos2D[k]->Reset();
+    for (unsigned int k = 0; k < histos3D.size(); k++) histos3D[k]->Reset();
+    ievent = numberOfElectrons = iErrors = 0;
+    recordBytes = -1;
+    stats = generatorStats_t();
+  }
+  return ok;
+}
+
+//
+//  Also removes the checkpoints of pTHat slices, <checkpoint>_s<k>
+//
+void removeCheckpoint(const string &checkpoint)
+{
+  unlink(checkpoint.c_str());
+  char text[32];
+  for (int k = 0; ; k++) {
+    sprintf(text, "_s%d", k);
+    string slice = checkpoint + text;
+    if (access(slice.c_str(), F_OK)) break;
+    unlink(slice.c_str());
+  }
+}
+
+//
+//  Pythia 8.1 dumps and reads its random number state only as a
+//  binary file. For the checkpoint it goes through a scratch file
+//  and is stored hex-encoded in the ROOT file.
+//
+bool rndmStateToText(Pythia &pythia, const string &scratch, string &text)
+{
+  string file = scratch + ".rndm";
+  text.clear();
+  bool ok = pythia.rndm.dumpState(file);
+  FILE *in = ok ? fopen(file.c_str(), "rb") : 0;
+  if (in) {
+    static const char digits[] = "0123456789abcdef";
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+      text += digits[c >> 4];
+      text += digits[c & 15];
+    }
+    fclose(in);
+  }
+  unlink(file.c_str());
+  return in && !text.empty();
+}
+
+bool rndmStateFromText(Pythia &pythia, const string &scratch, const string &text)
+{
+  if (text.empty() || text.size()%2) return false;
+  string file = scratch + ".rndm";
+  FILE *out = fopen(file.c_str(), "wb");
+  if (!out) return false;
+  for (unsigned int i = 0; i < text.size(); i += 2) {
+    unsigned int byte;
+    if (sscanf(text.substr(i, 2).c_str(), "%2x", &byte) != 1) {
+      fclose(out);
+      unlink(file.c_str());
+      return false;
+    }
+    fputc(byte, out);
+  }
+  bool ok = fclose(out) == 0 && pythia.rndm.readState(file);
+  unlink(file.c_str());
+  return ok;
+}
+
+//
+//  Precision targets "ptLow-ptHigh:relError/...", e.g.
+//  "2-4:0.01/4-8:0.02/8-15:0.05". "" or "void" means none.
+//
+bool parsePrecisionTargets(const string &spec, vector<precisionTarget_t> &targets)
+{
+  targets.clear();
+  if (spec.empty() || spec == "void") return true;
+  stringstream list(spec);
+  string item;
+  while (getline(list, item, '/')) {
+    precisionTarget_t target;
+    char tail;
+    if (sscanf(item.c_str(), "%lf-%lf:%lf%c", &target.ptLow, &target.ptHigh, &target.relError, &tail) != 3 ||
+	target.ptHigh <= target.ptLow || target.relError <= 0) return false;
+    targets.push_back(target);
+  }
+  return !targets.empty();
+}
+
+//
+//  CPU time of this process, all threads
+//
+double cpuSeconds()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6*(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+//
+//  CPU time of the calling thread
+//
+double threadCpuSeconds()
+{
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6*(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+//
+//  Sets up the monitor for nSlots generator loops from the card.
+//  The relative errors are multiplied by errorScale, the budget by
+//  budgetScale (both for --fork). Returns false if the card asks
+//  for neither targets nor a budget, i.e. a fixed number of events.
+//
+bool initMonitor(stoppingMonitor_t &monitor, Settings &settings, int nSlots, double errorScale, double budgetScale)
+{
+  if (!parsePrecisionTargets(settings.word("NPE:targetPrecision"), monitor.targets)) {
+    cout << "Error: malformed NPE:targetPrecision '" << settings.word("NPE:targetPrecision")
+	 << "', ignored" << endl;
+    monitor.targets.clear();
+  }
+  for (unsigned int k = 0; k < monitor.targets.size(); k++) monitor.targets[k].relError *= errorScale;
+  monitor.cpuBudget = settings.parm("NPE:cpuBudget")*budgetScale;
+  monitor.cpuStart = cpuSeconds();
+  monitor.cpuInit = 0;
+  monitor.nSlots = nSlots;
+  monitor.nBins = 0;      // known with the first update
+  monitor.sumw.clear();
+  monitor.sumw2.clear();
+  monitor.done = false;
+  pthread_mutex_init(&monitor.mutex, 0);
+  if (monitor.targets.empty() && monitor.cpuBudget <= 0) return false;
+
+  for (unsigned int k = 0; k < monitor.targets.size(); k++)
+    cout << "Target: relative error " << monitor.targets[k].relError << " for " << monitor.targets[k].ptLow
+	 << " < pT(e) < " << monitor.targets[k].ptHigh << " GeV/c" << endl;
+  if (monitor.cpuBudget > 0) cout << "CPU budget: " << monitor.cpuBudget << " s" << endl;
+  cout << "Main:numberOfEvents is the upper limit" << endl;
+  return true;
+}
+
+//
+//  Posts the yields of this slot's histos2D[0] in the target ranges,
+//  per delta-phi bin, and checks the combined precision and the CPU
+//  used. A target is met when every delta-phi bin of its pT range
+//  has the relative error (an empty bin never has). With report,
+//  prints where each target stands. Returns true once the loops
+//  should stop; this then holds for all slots.
+//
+bool updateMonitor(stoppingMonitor_t &monitor, int slot, vector<TH2D*> &histos2D, const char* tag, bool report)
+{
+  int nTargets = monitor.targets.size();
+  TH2D *h = histos2D[0];
+  TAxis *axis = h->GetXaxis();
+  int nBinsY = h->GetNbinsY();
+  vector<double> sumw(nTargets*nBinsY, 0.);
+  vector<double> sumw2(nTargets*nBinsY, 0.);
+  for (int k = 0; k < nTargets; k++) {
+    int first = axis->FindFixBin(monitor.targets[k].ptLow + 1e-9);
+    int last = axis->FindFixBin(monitor.targets[k].ptHigh - 1e-9);
+    for (int ix = first; ix <= last; ix++) {
+      for (int iy = 1; iy <= nBinsY; iy++) {
+	double error = h->GetBinError(ix, iy);
+	sumw[k*nBinsY + iy-1] += h->GetBinContent(ix, iy);
+	sumw2[k*nBinsY + iy-1] += error*error;
+      }
+    }
+  }
+
+  pthread_mutex_lock(&monitor.mutex);
+  if (monitor.nBins != nBinsY) {
+    monitor.nBins = nBinsY;
+    monitor.sumw.assign(monitor.nSlots*nTargets*nBinsY, 0.);
+    monitor.sumw2.assign(monitor.nSlots*nTargets*nBinsY, 0.);
+  }
+  for (int k = 0; k < nTargets*nBinsY; k++) {
+    monitor.sumw[slot*nTargets*nBinsY + k] = sumw[k];
+    monitor.sumw2[slot*nTargets*nBinsY + k] = sumw2[k];
+  }
+  if (!monitor.done) {
+    int nMet = 0;
+    char text[160];
+    for (int k = 0; k < nTargets; k++) {
+      double relError = 0;
+      for (int iy = 0; iy < nBinsY; iy++) {
+	double totalw = 0, totalw2 = 0;
+	for (int s = 0; s < monitor.nSlots; s++) {
+	  totalw += monitor.sumw[(s*nTargets + k)*nBinsY + iy];
+	  totalw2 += monitor.sumw2[(s*nTargets + k)*nBinsY + iy];
+	}
+	relError = max(relError, totalw > 0 ? sqrt(totalw2)/totalw : 1e30);
+      }
+      const precisionTarget_t &target = monitor.targets[k];
+      if (relError <= target.relError) nMet++;
+      if (report) {
+	sprintf(text, "%g < pT(e) < %g: worst relative error per delta-phi bin %.4g, target %.4g%s", target.ptLow,
+		target.ptHigh, relError, target.relError, relError <= target.relError ? " (met)" : "");
+	cout << tag << text << endl;
+      }
+    }
+    double cpu = cpuSeconds() - monitor.cpuStart - monitor.cpuInit;
+    if (report && monitor.cpuBudget > 0)
+      cout << tag << "CPU used " << cpu << " s of " << monitor.cpuBudget << " s" << endl;
+    if (nTargets > 0 && nMet == nTargets) {
+      monitor.done = true;
+      monitor.reason = "all precision targets met";
+    }
+    else if (monitor.cpuBudget > 0 && cpu >= monitor.cpuBudget) {
+      monitor.done = true;
+      sprintf(text, "CPU budget used up, %d of %d targets met", nMet, nTargets);
+      monitor.reason = text;
+    }
+  }
+  bool done = monitor.done;
+  pthread_mutex_unlock(&monitor.mutex);
+  return done;
+}
+
+//
+//  Throughput report: rates over the elapsed time, the share of
+//  each phase in the timed total and the peak memory. With several
+//  threads the rates are per thread on average.
+//
+void printPerf(const char* tag, const perfCounters_t &perf)
+{
+  double total = 0;
+  for (int k = 0; k < perfCounters_t::kNPhases; k++) total += perf.seconds[k];
+  if (perf.wall <= 0 || total <= 0) return;
+  char text[256];
+  sprintf(text, "%.1f events/s, %.1f accepted/s, %.1f triggers/s, %.3g pairs/s, peak RSS %.0f MB; ",
+	  perf.events/perf.wall, perf.accepted/perf.wall, perf.triggers/perf.wall,
+	  perf.pairs/perf.wall, peakRSS());
+  cout << tag << text;
+  for (int k = 0; k < perfCounters_t::kNPhases; k++) {
+    sprintf(text, "%s %.1f%%%s", perfCounters_t::phaseName(k), 100*perf.seconds[k]/total,
+	    k+1 < perfCounters_t::kNPhases ? ", " : "");
+    cout << text;
+  }
+  cout << endl;
+}
+
+//
+//  Summary histogram perfSummary<name> in the current directory,
+//  one labeled bin per quantity. Merged files add them up, so it
+//  only holds quantities that add: the CPU time per phase and the
+//  counters. Elapsed time and peak RSS of the job go into the
+//  TNamed perfJob<name>, which NPEHMerge does not merge.
+//
+void writePerfSummary(const perfCounters_t &perf, const char* histname)
+{
+  const int nBins = perfCounters_t::kNPhases + 4;
+  char text[128];
+  char title[128];
+  sprintf(text, "perfSummary%s", histname);
+  TH1D *h = new TH1D(text, "timing [s], counters", nBins, 0, nBins);
+  int bin = 1;
+  for (int k = 0; k < perfCounters_t::kNPhases; k++, bin++) {
+    sprintf(text, "time %s", perfCounters_t::phaseName(k));
+    h->GetXaxis()->SetBinLabel(bin, text);
+    h->SetBinContent(bin, perf.seconds[k]);
+  }
+  const char* labels[4] = {"events", "accepted events", "triggers", "pairs"};
+  double values[4] = {double(perf.events), double(perf.accepted), double(perf.triggers), double(perf.pairs)};
+  for (int k = 0; k < 4; k++, bin++) {
+    h->GetXaxis()->SetBinLabel(bin, labels[k]);
+    h->SetBinContent(bin, values[k]);
+  }
+
+  sprintf(text, "perfJob%s", histname);
+  sprintf(title, "time elapsed %.1f s, peak RSS %.1f MB", perf.wall, peakRSS());
+  TNamed job(text, title);
+  job.Write();
+}
+
+//
+//  Event analysis
+//
+int myEvent(Pythia& pythia, eventSnapshot_t &snapshot, vector<TH2D*> &histos2D, vector<TH3F*> &histos3D,
+	    const vector<cutSet_t> &cutSets, double weight, perfCounters_t &perf,
+	    int triggerParent)
+{
+  double t0 = perfClock();
+  fillSnapshot(pythia.event, snapshot, triggerParent);
+  perf.seconds[perfCounters_t::kSnapshot] += perfClock() - t0;
+  return analyzeEvent(snapshot, histos2D, histos3D, cutSets, weight, &perf);
+}
+
+//
+//  Copy what the analysis needs into the snapshot: all charged
+//  final-state particles and all electrons. pT, eta, phi etc.
+//  are computed here once from the four-momenta. For electrons
+//  the id of the (single) mother is looked up as well. With
+//  forced decays only the electrons of triggerParent (the last
+//  hadron of the forced chain, 0 if none) keep their mother id,
+//  which leaves the others out of the trigger selection; -1 keeps
+//  all.
+//
+void fillSnapshot(const Event &event, eventSnapshot_t &snapshot, int triggerParent)
+{
+  snapshot.clear();
+  vector<int> &ancestor = snapshot.ancestorOfRecord;
+  labelHeavyFlavorAncestors(event, ancestor);
+  for (int i = 1; i < event.size(); i++) {
+    const Particle &p = event[i];
+    bool electron = abs(p.id()) == 11;
+    if (!electron && !(p.isFinal() && p.isCharged())) continue;
+    int motherId = 0;
+    if (electron) {
+      vector<int> mothers = event.motherList(i);
+      if (mothers.size() > 1) snapshot.motherError = true;
+      if (mothers.size() == 1 && (triggerParent < 0 || mothers[0] == triggerParent))
+	motherId = event[mothers[0]].id();
+    }
+    snapshot.index.push_back(i);
+    snapshot.id.push_back(p.id());
+    snapshot.status.push_back(p.status());
+    snapshot.charge.push_back(p.charge());
+    snapshot.pt.push_back(p.pT());
+    snapshot.eta.push_back(p.eta());
+    snapshot.phi.push_back(p.phi());
+    snapshot.y.push_back(p.y());
+    snapshot.m0.push_back(p.m0());
+    snapshot.motherId.push_back(motherId);
+    snapshot.hfAncestor.push_back(ancestor[i]);
+    snapshot.hfAncestorFlavor.push_back(ancestor[i] >= 0 ? hfFlavor(event[ancestor[i]].id()) : 0);
+  }
+}
+
+//
+//  Label every entry of the event record with the first (i.e.
+//  outermost) c/b hadron of the decay chain it comes from, or -1.
+//  Decay products (status 91-99) have a single mother that always
+//  precedes them in the record, so one forward pass suffices:
+//  a product inherits the label of its mother, or gets the mother
+//  itself if that is an unlabeled c/b hadron. For B -> D -> e the
+//  electron and all other B and D products end up with the same
+//  label, so "from the same B" is a comparison of two labels.
+//  This replaces the O(N^2) Event::isAncestor() searches.
+//
+void labelHeavyFlavorAncestors(const Event &event, vector<int> &ancestor)
+{
+  ancestor.assign(event.size(), -1);
+  for (int i = 1; i < event.size(); i++) {
+    int status = abs(event[i].status());
+    if (status < 91 || status > 99) continue;
+    int m = event[i].mother1();
+    if (m <= 0 || m >= i) continue;
+    if (ancestor[m] >= 0) ancestor[i] = ancestor[m];
+    else if (event[m].isHadron() && (hfFlavor(event[m].id()) == 4 || hfFlavor(event[m].id()) == 5))
+      ancestor[i] = m;
+  }
+}
+
+//
+//  Event record for --reanalyze. Only events with an electron
+//  from a c/b hadron within |eta| < 1.5 are kept (returns false
+//  otherwise). The record holds these electrons, their c/b mother
+//  and its mother, and all charged final-state particles within
+//  |eta| < 1.5, which leaves room to widen the acceptance cuts.
+//
+bool fillRecord(const Event &event, const eventSnapshot_t &ev, vector<npeRecordParticle_t> &record)
+{
+  const double maxEta = 1.5;
+  record.clear();
+  vector<int> mothers;   // record indices of mothers/grandmothers already stored
+  bool trigger = false;
+  for (int i = 0; i < ev.size(); i++) {
+    if (fabs(ev.eta[i]) > maxEta) continue;
+    int flavor = hfFlavor(ev.motherId[i]);
+    unsigned char role = 0;
+    if (abs(ev.id[i]) == 11 && (flavor == 4 || flavor == 5)) role |= kRoleTrigger;
+    if (ev.status[i] > 0 && ev.charge[i] != 0) role |= kRoleAssociated;
+    if (!role) continue;
+
+    npeRecordParticle_t p;
+    p.id = ev.id[i];
+    p.status = ev.status[i];
+    p.motherId = ev.motherId[i];
+    p.hfAncestor = ev.hfAncestor[i];
+    p.pt = ev.pt[i];
+    p.eta = ev.eta[i];
+    p.phi = ev.phi[i];
+    p.y = ev.y[i];
+    p.m0 = ev.m0[i];
+    p.charge3 = static_cast<signed char>(floor(3*ev.charge[i] + 0.5));
+    p.hfAncestorFlavor = ev.hfAncestorFlavor[i];
+    p.role = role;
+    p.reserved = 0;
+    record.push_back(p);
+    if (!(role & kRoleTrigger)) continue;
+    trigger = true;
+
+    //
+    //  c/b mother and grandmother of the trigger
+    //
+    int m = event[ev.index[i]].mother1();
+    for (int generation = 0; generation < 2 && m > 0; generation++) {
+      bool stored = false;
+      for (unsigned int k = 0; k < mothers.size(); k++) stored |= mothers[k] == m;
+      if (!stored) {
+	const Particle &mp = event[m];
+	p.id = mp.id();
+	p.status = mp.status();
+	p.motherId = event[mp.mother1()].id();
+	p.hfAncestor = ev.ancestorOfRecord[m];
+	p.pt = mp.pT();
+	p.eta = mp.pT() > 0 ? mp.eta() : 0;
+	p.phi = mp.phi();
+	p.y = mp.y();
+	p.m0 = mp.m0();
+	p.charge3 = static_cast<signed char>(floor(3*mp.charge() + 0.5));
+	p.hfAncestorFlavor = p.hfAncestor >= 0 ? hfFlavor(event[p.hfAncestor].id()) : 0;
+	p.role = generation == 0 ? kRoleMother : kRoleGrandmother;
+	record.push_back(p);
+	mothers.push_back(m);
+      }
+      m = event[m].mother1();
+    }
+  }
+  return trigger;
+}
+
+//
+//  --reanalyze: run the analysis over a saved event record with
+//  the stored event weights. Returns the number of events with a
+//  c/b electron in the acceptance, -1 if the file is unreadable.
+//
+int reanalyzeRecords(const char* filename, vector<TH2D*> &histos2D, vector<TH3F*> &histos3D,
+		     const vector<cutSet_t> &cutSets, int &numberOfElectrons)
+{
+  npeRecordReader_t reader;
+  if (!reader.open(filename)) return -1;
+  cout << "Event record '" << filename << "': " << reader.nEvents() << " events in "
+       << reader.nChunks() << " chunks" << endl;
+
+  eventSnapshot_t snapshot;
+  int ievent = 0;
+  int nParticles;
+  double weight;
+  const npeRecordParticle_t *particles;
+  while ((particles = reader.next(nParticles, weight))) {
+    recordToSnapshot(particles, nParticles, snapshot);
+    int n = analyzeEvent(snapshot, histos2D, histos3D, cutSets, weight);
+    if (n == 0) continue;
+    numberOfElectrons += n;
+    ievent++;
+  }
+  cout << "# of events analyzed = " << ievent
+       << ", # of electrons from c/b hadron decays = " << numberOfElectrons << endl;
+  return ievent;
 }
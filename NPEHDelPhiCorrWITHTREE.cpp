@@ -5,6 +5,10 @@
 //  in 200 GeV pp collisions with Pythia8.
 //
 //  The decays are stored in a ROOT tree and written to file.
+//  One tree entry per trigger electron, including the delta-phi
+//  and delta-eta of all its pairs. The tree is filled by a
+//  background writer thread, so ROOT compression and basket
+//  flushes overlap with event generation.
 //
 //  Once written most things can be controlled through the runcard,
 //  so there's no need to recompile.
@@ -15,11 +19,14 @@
 //  Last update: September 9, 2008
 //==============================================================================
 #include <cmath>
+#include <cstring>
+#include <pthread.h>
 #include "Pythia.h"
 #include "TTree.h"
 #include "TFile.h"
 #include <vector>
 #include "TH2.h"
+#include "TH1D.h"
 #define PR(x) std::cout << #x << " = " << (x) << std::endl;
 using namespace Pythia8; 
 
@@ -28,13 +35,22 @@ using namespace Pythia8;
 //
 bool isInAcceptanceE(int, const Event&);  // acceptance filter electron candidate
 bool isInAcceptanceH(int, const Event&);  // acceptance filter hadron candidate
-int myEvent(Pythia&, double);            // event handler (analyze event)
+class recordQueue_t;
+int myEvent(Pythia&, double, recordQueue_t&);  // event handler (analyze event)
 double deltaPhi(double, double); 
 double deltaEta(double, double);
+void* writerThread(void*);
 //TH2F* deltaPhiPt = new TH2F("deltaPhiPt","",200,-10,10,200,0,20);
 //TH2F* deltaEtaPt = new TH2F("deltaEtaPt","",200,-5,5,200,0,20);
-vector<float> dPhiV;
-vector<float> dEtaV;
+
+//
+//  At most kMaxPairs trigger-hadron pairs are stored per trigger.
+//  Pairs beyond the cap are not written but counted in droppedPairs
+//  and reported at the end of the run, since dPhi[nPairs] is then
+//  biased for high-multiplicity events.
+//
+const int kMaxPairs = 1000;   // max. number of pairs stored per trigger
+const int kQueueSize = 256;   // records in flight between generator and writer
 
 //
 // This structure contains all the info we 
@@ -74,13 +90,87 @@ struct hf2eDecay_t {
   float pdf2;
   int   code;
   float sigmaGen;
-  float weight;   // useful for normalization/x-section
-  float delPhi;
-  float delEta;
- 
+  float weight;   // useful for normalization/x-section, includes evtWeight
+  float evtWeight;  // Pythia event weight, != 1 with PhaseSpace:bias2Selection
+
+  int   nPairs;   // pairs with the associated hadrons
+  float dPhi[kMaxPairs];
+  float dEta[kMaxPairs];
 };
 
-hf2eDecay_t hf2eDecay;
+hf2eDecay_t hf2eDecay;   // branch buffer, owned by the writer thread
+long droppedPairs = 0;   // pairs beyond kMaxPairs, generator thread only
+
+//
+//  Fixed-size ring buffer of records between the generator
+//  (producer) and the writer thread (consumer). push() blocks
+//  while the queue is full, so memory stays flat no matter
+//  how far the writer falls behind.
+//
+class recordQueue_t {
+public:
+  recordQueue_t() : head(0), tail(0), count(0), closed(false) {
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&notFull, 0);
+    pthread_cond_init(&notEmpty, 0);
+  }
+  ~recordQueue_t() {
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+  }
+  void push(const hf2eDecay_t &record) {
+    pthread_mutex_lock(&mutex);
+    while (count == kQueueSize) pthread_cond_wait(&notFull, &mutex);
+    copyRecord(slots[tail], record);
+    tail = (tail+1)%kQueueSize;
+    count++;
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+  }
+  // false once the queue is closed and drained
+  bool pop(hf2eDecay_t &record) {
+    pthread_mutex_lock(&mutex);
+    while (count == 0 && !closed) pthread_cond_wait(&notEmpty, &mutex);
+    if (count == 0) {
+      pthread_mutex_unlock(&mutex);
+      return false;
+    }
+    copyRecord(record, slots[head]);
+    head = (head+1)%kQueueSize;
+    count--;
+    pthread_cond_signal(&notFull);
+    pthread_mutex_unlock(&mutex);
+    return true;
+  }
+  void close() {
+    pthread_mutex_lock(&mutex);
+    closed = true;
+    pthread_cond_broadcast(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+  }
+private:
+  // only the used part of the pair arrays is copied
+  static void copyRecord(hf2eDecay_t &to, const hf2eDecay_t &from) {
+    memcpy(&to, &from, reinterpret_cast<const char*>(from.dPhi) - reinterpret_cast<const char*>(&from));
+    memcpy(to.dPhi, from.dPhi, from.nPairs*sizeof(float));
+    memcpy(to.dEta, from.dEta, from.nPairs*sizeof(float));
+  }
+  hf2eDecay_t slots[kQueueSize];
+  int head;
+  int tail;
+  int count;
+  bool closed;
+  pthread_mutex_t mutex;
+  pthread_cond_t notFull;
+  pthread_cond_t notEmpty;
+};
+
+struct writerJob_t {
+  recordQueue_t *queue;
+  TTree *tree;
+  long nWritten;
+};
 
 int main(int argc, char* argv[]) {
     
@@ -106,8 +196,22 @@ int main(int argc, char* argv[]) {
 	      "hf_id/I:hf_status/I:hf_pt/F:hf_pz/F:hf_phi/F:hf_eta/F:hf_y/F:"
 	      "e_id/I:e_status/I:e_pt/F:e_pz/F:e_phi/F:e_eta/F:e_y/F:"
 	      "q1_id/I:q1_x/F:q2_id/I:q2_x/F:"
-	      "Q2fac/F:alphas/F:ptHat/F:nFinal/I:pdf1/F:pdf2/F:code/I:sigmaGen/F:weight/F:"
-	      "dPhiV/F:dEtaV/F");
+	      "Q2fac/F:alphas/F:ptHat/F:nFinal/I:pdf1/F:pdf2/F:code/I:sigmaGen/F:weight/F:evtWeight/F");
+  // dPhi/dEta hold at most kMaxPairs (1000) pairs per trigger
+  tree.Branch("nPairs", &hf2eDecay.nPairs, "nPairs/I");
+  tree.Branch("dPhi", hf2eDecay.dPhi, "dPhi[nPairs]/F");
+  tree.Branch("dEta", hf2eDecay.dEta, "dEta[nPairs]/F");
+
+  //
+  //  From here on only the writer thread touches the tree
+  //
+  recordQueue_t *queue = new recordQueue_t;
+  writerJob_t writer;
+  writer.queue = queue;
+  writer.tree = &tree;
+  writer.nWritten = 0;
+  pthread_t writerId;
+  pthread_create(&writerId, 0, writerThread, &writer);
     
   //
   //  Create instance of Pythia 
@@ -166,6 +270,8 @@ int main(int argc, char* argv[]) {
   int numberOfElectrons = 0;
   int iErrors = 0;
   int n;
+  double sumW = 0;     // Pythia event weights, see eventWeights below
+  double sumW2 = 0;
     
   while (ievent < maxNumberOfEvents) {
         
@@ -174,10 +280,11 @@ int main(int argc, char* argv[]) {
       cout << "Error: too many errors in event generation - check your settings & code" << endl;
       break;
     }
-    n = myEvent(pythia, maxNumberOfEvents);  // in myEvent we deal with the whole event and return
+    n = myEvent(pythia, maxNumberOfEvents, *queue);  // in myEvent we deal with the whole event and return
     // the number of electrons recorded for book keeping
     numberOfElectrons += n; 
-    if (n) tree.Fill();   
+    sumW += pythia.info.weight();
+    sumW2 += pythia.info.weight()*pythia.info.weight();
     ievent++;
     if (ievent%pace == 0) {
       cout << "# of events generated = " << ievent 
@@ -195,7 +302,27 @@ int main(int argc, char* argv[]) {
   //--------------------------------------------------------------
   //  Finish up
   //--------------------------------------------------------------
+  queue->close();
+  pthread_join(writerId, 0);
+  delete queue;
+  cout << "Tree entries written = " << writer.nWritten << endl;
+  if (droppedPairs)
+    cout << "Warning: " << droppedPairs << " pairs dropped, more than "
+	 << kMaxPairs << " pairs per trigger" << endl;
+
   pythia.statistics();
+
+  //
+  //  With PhaseSpace:bias2Selection the weights only average to
+  //  one; the exact normalization is sigmaGen/sumW instead of
+  //  sigmaGen/nEvents, i.e. scale the tree weights by nEvents/sumW.
+  //
+  cout << "Sum of event weights = " << sumW << " over " << ievent << " events" << endl;
+  TH1D *eventWeights = new TH1D("eventWeights", "events, sum of weights, sum of weights^2, sigmaGen [mb]", 4, 0, 4);
+  eventWeights->SetBinContent(1, ievent);
+  eventWeights->SetBinContent(2, sumW);
+  eventWeights->SetBinContent(3, sumW2);
+  eventWeights->SetBinContent(4, pythia.info.sigmaGen());
   cout << "Writing File" << endl;
   hfile->Write();
     
@@ -203,11 +330,27 @@ int main(int argc, char* argv[]) {
 }
 
 //
-//  Event analysis
+//  Writer thread: moves records from the queue into the tree
+//  until the generator closes the queue.
+//
+void* writerThread(void* arg)
+{
+  writerJob_t &writer = *static_cast<writerJob_t*>(arg);
+  while (writer.queue->pop(hf2eDecay)) {
+    writer.tree->Fill();
+    writer.nWritten++;
+  }
+  return 0;
+}
+
+//
+//  Event analysis. Every c/b electron in the acceptance gives one
+//  record that is handed to the writer thread.
 //
-int myEvent(Pythia& pythia, double nMaxEvt)
+int myEvent(Pythia& pythia, double nMaxEvt, recordQueue_t &queue)
 {
   Event &event = pythia.event;
+  hf2eDecay_t record;
 
   int nelectrons = 0;
   int ic = 0;
@@ -272,45 +415,46 @@ int myEvent(Pythia& pythia, double nMaxEvt)
       // If no origin or more than 1 than id == 0
       // and the status identifies what happens: -1 no mother, 
       // -2 more than 1. This should not happen at all, but ...
-      hf2eDecay.orig_id     = iorig >= 0 ? event[iorig].id() : 0;
-      hf2eDecay.orig_status = iorig >= 0 ? event[iorig].status() : iorig;
+      record.orig_id     = iorig >= 0 ? event[iorig].id() : 0;
+      record.orig_status = iorig >= 0 ? event[iorig].status() : iorig;
             
-      hf2eDecay.hf_id     = event[ic].id();  
-      hf2eDecay.hf_status = event[ic].status();
-      hf2eDecay.hf_pt     = event[ic].pT();
-      hf2eDecay.hf_pz     = event[ic].pz();
-      hf2eDecay.hf_phi    = event[ic].phi();
-      hf2eDecay.hf_eta    = event[ic].eta();     
-      hf2eDecay.hf_y      = event[ic].y();
+      record.hf_id     = event[ic].id();  
+      record.hf_status = event[ic].status();
+      record.hf_pt     = event[ic].pT();
+      record.hf_pz     = event[ic].pz();
+      record.hf_phi    = event[ic].phi();
+      record.hf_eta    = event[ic].eta();     
+      record.hf_y      = event[ic].y();
             
-      hf2eDecay.e_id       = event[i].id();     
-      hf2eDecay.e_status   = event[i].status();
-      hf2eDecay.e_pt    = event[i].pT();
-      hf2eDecay.e_pz    = event[i].pz();
-      hf2eDecay.e_phi    = event[i].phi();
-      hf2eDecay.e_eta      = event[i].eta();     
-      hf2eDecay.e_y    = event[i].y();
+      record.e_id       = event[i].id();     
+      record.e_status   = event[i].status();
+      record.e_pt    = event[i].pT();
+      record.e_pz    = event[i].pz();
+      record.e_phi    = event[i].phi();
+      record.e_eta      = event[i].eta();     
+      record.e_y    = event[i].y();
             
-      hf2eDecay.q1_id      = pythia.info.id1();
-      hf2eDecay.q1_x       = pythia.info.x1();
-      hf2eDecay.q2_id      = pythia.info.id2();
-      hf2eDecay.q2_x       = pythia.info.x2();
-      hf2eDecay.Q2fac      = pythia.info.Q2Fac();
-      hf2eDecay.alphas     = pythia.info.alphaS();
-      hf2eDecay.ptHat      = pythia.info.pTHat();
-      hf2eDecay.nFinal     = pythia.info.nFinal();
-      hf2eDecay.pdf1       = pythia.info.pdf1();
-      hf2eDecay.pdf2       = pythia.info.pdf2();
-      hf2eDecay.code       = pythia.info.code();
-      hf2eDecay.sigmaGen   = pythia.info.sigmaGen();
-      hf2eDecay.weight     = pythia.info.sigmaGen()/nMaxEvt; // useful for obtaining x-section
-      // vector branches already assigned in branch declaration
+      record.q1_id      = pythia.info.id1();
+      record.q1_x       = pythia.info.x1();
+      record.q2_id      = pythia.info.id2();
+      record.q2_x       = pythia.info.x2();
+      record.Q2fac      = pythia.info.Q2Fac();
+      record.alphas     = pythia.info.alphaS();
+      record.ptHat      = pythia.info.pTHat();
+      record.nFinal     = pythia.info.nFinal();
+      record.pdf1       = pythia.info.pdf1();
+      record.pdf2       = pythia.info.pdf2();
+      record.code       = pythia.info.code();
+      record.sigmaGen   = pythia.info.sigmaGen();
+      record.evtWeight  = pythia.info.weight();
+      record.weight     = pythia.info.sigmaGen()/nMaxEvt*record.evtWeight; // useful for obtaining x-section
 
       double phi1, phi2;
       double eta1, eta2;
       int hid;
       phi1 = event[i].phi();
       eta1 = event[i].eta();
+      record.nPairs = 0;
       for (unsigned int ih=0; ih<hadrons.size(); ih++) {
         hid = hadrons[ih];
         phi2 = event[hid].phi();
@@ -318,15 +462,23 @@ int myEvent(Pythia& pythia, double nMaxEvt)
         float dphi = deltaPhi(phi1, phi2);
         float deta = deltaEta(eta1, eta2);
         if(event[hid].pT()<0.2) continue;
-	dPhiV.push_back(dphi);
-	dEtaV.push_back(deta);
+	if (record.nPairs == kMaxPairs) {
+	  if (droppedPairs++ == 0)
+	    cout << "Warning: more than " << kMaxPairs
+		 << " pairs for one trigger, extra pairs are dropped" << endl;
+	  continue;
+	}
+	record.dPhi[record.nPairs] = dphi;
+	record.dEta[record.nPairs] = deta;
+	record.nPairs++;
 	//deltaPhiPt -> Fill(dphi,(float)event[i].pT());
 	//deltaEtaPt -> Fill(deta,(float)event[i].pT());
-      }                          
+      }
+      queue.push(record);
     }    
-
-    return nelectrons;
   }
+
+  return nelectrons;
 }
 
 //
@@ -0,0 +1,313 @@
+//==============================================================================
+//  NPEHEventRecord.h
+//
+//  Event snapshot used by the NPE-h analysis and a compact binary
+//  record of such snapshots, so that cuts and binnings can be
+//  changed and the analysis rerun without regenerating the events.
+//
+//  Record file layout (native byte order, everything 8-byte aligned):
+//
+//    npeRecordFileHeader_t
+//    chunk 0: npeRecordChunkHeader_t
+//             npeRecordEvent_t    x nEvents
+//             npeRecordParticle_t x nParticles
+//    chunk 1: ...
+//
+//  Chunks are written in one go, so a file cut short by an evicted
+//  job loses at most its last, incomplete chunk. The reader maps
+//  the whole file and hands out pointers into it.
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#ifndef NPEHEventRecord_h
+#define NPEHEventRecord_h
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+//  Structure-of-arrays copy of the particles of one event the
+//  analysis looks at (charged final-state particles and all
+//  electrons). Filled once per event so the analysis loops run
+//  over contiguous arrays instead of recomputing pT, eta, phi
+//  from the four-momenta of Pythia's Particle objects. The
+//  vectors keep their capacity from event to event.
+//
+struct eventSnapshot_t {
+  eventSnapshot_t() : motherError(false) {}
+  int size() const {return static_cast<int>(id.size());}
+  void clear() {
+    index.clear(); id.clear(); status.clear(); charge.clear();
+    pt.clear(); eta.clear(); phi.clear(); y.clear(); m0.clear(); motherId.clear();
+    hfAncestor.clear(); hfAncestorFlavor.clear();
+    motherError = false;
+  }
+  std::vector<int>    index;     // position in the Pythia event record
+  std::vector<int>    id;
+  std::vector<int>    status;
+  std::vector<double> charge;
+  std::vector<double> pt;
+  std::vector<double> eta;
+  std::vector<double> phi;
+  std::vector<double> y;
+  std::vector<double> m0;
+  std::vector<int>    motherId;  // electrons only: id of the mother, 0 otherwise
+  std::vector<int>    hfAncestor;        // record index of the outermost c/b hadron ancestor, -1 if none
+  std::vector<int>    hfAncestorFlavor;  // its flavor (4 or 5), 0 if none
+  bool motherError;         // an electron with more than one mother
+  std::vector<int>    ancestorOfRecord;  // scratch: hfAncestor for every entry of the event record
+};
+
+//
+//  On-disk structures
+//
+const char         kNpeRecordMagic[8] = {'N','P','E','H','R','E','C','1'};
+const unsigned int kNpeChunkMagic     = 0x4b4e4843;  // "CHNK"
+
+enum npeRecordRole_t {
+  kRoleTrigger     = 1,   // electron from a c/b hadron
+  kRoleAssociated  = 2,   // charged final-state particle
+  kRoleMother      = 4,   // c/b mother of a trigger
+  kRoleGrandmother = 8    // origin of that c/b hadron
+};
+
+struct npeRecordFileHeader_t {
+  char         magic[8];
+  unsigned int version;
+  unsigned int particleSize;   // sizeof(npeRecordParticle_t) of the writer
+};
+
+struct npeRecordChunkHeader_t {
+  unsigned int magic;
+  unsigned int nEvents;
+  unsigned int nParticles;
+  unsigned int reserved;
+};
+
+struct npeRecordEvent_t {
+  unsigned int firstParticle;  // within the chunk
+  unsigned int nParticles;
+  double       weight;
+};
+
+struct npeRecordParticle_t {
+  int   id;
+  int   status;
+  int   motherId;          // id of the mother (electrons only)
+  int   hfAncestor;        // key of the outermost c/b hadron ancestor, -1 if none
+  float pt;
+  float eta;
+  float phi;
+  float y;
+  float m0;
+  signed char   charge3;   // three times the charge
+  signed char   hfAncestorFlavor;
+  unsigned char role;      // npeRecordRole_t bits
+  unsigned char reserved;
+};
+
+//
+//  Appends events to a record file. Events are buffered and
+//  written as one chunk every kChunkEvents events or on flush().
+//
+class npeRecordWriter_t {
+public:
+  npeRecordWriter_t() : mFile(0) {}
+  ~npeRecordWriter_t() {close();}
+
+  //
+  //  Opens a new file, or, if truncateTo >= 0, continues an existing
+  //  one after cutting it back to truncateTo bytes (used on resume).
+  //
+  bool open(const std::string &name, long truncateTo = -1) {
+    close();
+    if (truncateTo >= 0 && truncate(name.c_str(), truncateTo) == 0) {
+      mFile = fopen(name.c_str(), "ab");
+      return mFile != 0;
+    }
+    mFile = fopen(name.c_str(), "wb");
+    if (!mFile) return false;
+    npeRecordFileHeader_t header;
+    memcpy(header.magic, kNpeRecordMagic, sizeof(header.magic));
+    header.version = 1;
+    header.particleSize = sizeof(npeRecordParticle_t);
+    return fwrite(&header, sizeof(header), 1, mFile) == 1;
+  }
+
+  void addEvent(const std::vector<npeRecordParticle_t> &particles, double weight) {
+    npeRecordEvent_t event;
+    event.firstParticle = mParticles.size();
+    event.nParticles = particles.size();
+    event.weight = weight;
+    mEvents.push_back(event);
+    mParticles.insert(mParticles.end(), particles.begin(), particles.end());
+    if (mEvents.size() >= kChunkEvents) flush();
+  }
+
+  void flush() {
+    if (!mFile) return;
+    if (!mEvents.empty()) {
+      npeRecordChunkHeader_t chunk;
+      chunk.magic = kNpeChunkMagic;
+      chunk.nEvents = mEvents.size();
+      chunk.nParticles = mParticles.size();
+      chunk.reserved = 0;
+      fwrite(&chunk, sizeof(chunk), 1, mFile);
+      fwrite(&mEvents[0], sizeof(npeRecordEvent_t), mEvents.size(), mFile);
+      if (!mParticles.empty())
+	fwrite(&mParticles[0], sizeof(npeRecordParticle_t), mParticles.size(), mFile);
+      mEvents.clear();
+      mParticles.clear();
+    }
+    fflush(mFile);
+  }
+
+  // file size after flushing, -1 if not open
+  long bytes() {
+    if (!mFile) return -1;
+    flush();
+    return ftell(mFile);
+  }
+
+  void close() {
+    if (!mFile) return;
+    flush();
+    fclose(mFile);
+    mFile = 0;
+  }
+
+  static const unsigned int kChunkEvents = 4096;
+
+private:
+  FILE *mFile;
+  std::vector<npeRecordEvent_t>    mEvents;
+  std::vector<npeRecordParticle_t> mParticles;
+};
+
+//
+//  Read-only view of a record file. open() maps the file and
+//  indexes its complete chunks; events can then be read in order
+//  with next() or per chunk.
+//
+class npeRecordReader_t {
+public:
+  npeRecordReader_t() : mData(0), mSize(0), mChunk(0), mEvent(0) {}
+  ~npeRecordReader_t() {close();}
+
+  bool open(const std::string &name) {
+    close();
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(npeRecordFileHeader_t))) {
+      ::close(fd);
+      return false;
+    }
+    mSize = st.st_size;
+    void *data = mmap(0, mSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      mSize = 0;
+      return false;
+    }
+    mData = static_cast<const char*>(data);
+
+    const npeRecordFileHeader_t *header = reinterpret_cast<const npeRecordFileHeader_t*>(mData);
+    if (memcmp(header->magic, kNpeRecordMagic, sizeof(header->magic)) ||
+	header->particleSize != sizeof(npeRecordParticle_t)) {
+      close();
+      return false;
+    }
+
+    size_t pos = sizeof(npeRecordFileHeader_t);
+    while (pos + sizeof(npeRecordChunkHeader_t) <= mSize) {
+      const npeRecordChunkHeader_t *chunk = reinterpret_cast<const npeRecordChunkHeader_t*>(mData+pos);
+      size_t length = sizeof(npeRecordChunkHeader_t) + chunk->nEvents*sizeof(npeRecordEvent_t)
+	+ chunk->nParticles*sizeof(npeRecordParticle_t);
+      if (chunk->magic != kNpeChunkMagic || pos + length > mSize) break;  // truncated
+      mChunks.push_back(chunk);
+      pos += length;
+    }
+    return true;
+  }
+
+  void close() {
+    if (mData) munmap(const_cast<char*>(mData), mSize);
+    mData = 0;
+    mSize = 0;
+    mChunks.clear();
+    mChunk = mEvent = 0;
+  }
+
+  int nChunks() const {return mChunks.size();}
+  int nEvents(int chunk) const {return mChunks[chunk]->nEvents;}
+  long nEvents() const {
+    long n = 0;
+    for (unsigned int k = 0; k < mChunks.size(); k++) n += mChunks[k]->nEvents;
+    return n;
+  }
+
+  //
+  //  Event i of a chunk: pointer to its particles, their number and
+  //  the event weight
+  //
+  const npeRecordParticle_t* event(int chunk, int i, int &nParticles, double &weight) const {
+    const npeRecordChunkHeader_t *header = mChunks[chunk];
+    const npeRecordEvent_t *events = reinterpret_cast<const npeRecordEvent_t*>(header+1);
+    const npeRecordParticle_t *particles = reinterpret_cast<const npeRecordParticle_t*>(events + header->nEvents);
+    nParticles = events[i].nParticles;
+    weight = events[i].weight;
+    return particles + events[i].firstParticle;
+  }
+
+  // sequential access, returns 0 at the end
+  const npeRecordParticle_t* next(int &nParticles, double &weight) {
+    while (mChunk < static_cast<int>(mChunks.size()) && mEvent >= nEvents(mChunk)) {
+      mChunk++;
+      mEvent = 0;
+    }
+    if (mChunk >= static_cast<int>(mChunks.size())) return 0;
+    return event(mChunk, mEvent++, nParticles, weight);
+  }
+
+private:
+  const char *mData;
+  size_t mSize;
+  std::vector<const npeRecordChunkHeader_t*> mChunks;
+  int mChunk;   // position for next()
+  int mEvent;
+};
+
+//
+//  Rebuild the analysis snapshot from a recorded event. Mother and
+//  grandmother entries are not part of the snapshot.
+//
+inline void recordToSnapshot(const npeRecordParticle_t *particles, int n, eventSnapshot_t &snapshot)
+{
+  snapshot.clear();
+  for (int i = 0; i < n; i++) {
+    const npeRecordParticle_t &p = particles[i];
+    if (!(p.role & (kRoleTrigger | kRoleAssociated))) continue;
+    snapshot.index.push_back(i);
+    snapshot.id.push_back(p.id);
+    snapshot.status.push_back(p.status);
+    snapshot.charge.push_back(p.charge3/3.);
+    snapshot.pt.push_back(p.pt);
+    snapshot.eta.push_back(p.eta);
+    snapshot.phi.push_back(p.phi);
+    snapshot.y.push_back(p.y);
+    snapshot.m0.push_back(p.m0);
+    snapshot.motherId.push_back(p.motherId);
+    snapshot.hfAncestor.push_back(p.hfAncestor);
+    snapshot.hfAncestorFlavor.push_back(p.hfAncestorFlavor);
+  }
+}
+
+#endif
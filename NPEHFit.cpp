@@ -0,0 +1,127 @@
+//==============================================================================
+//  NPEHFit.cpp
+//
+//  Extracts the B fraction in electron pT bins: the delta-phi
+//  distribution of the data is fitted with the B and C templates
+//  (merged histos2D<name>0), one fit per pT bin, the bins in
+//  parallel; see NPEHTemplateFit.h.
+//
+//  Usage: NPEHFit data.root dataHist B.root BHist C.root CHist
+//                 [--pt e0,e1,...] [--threads N] [--output fit.root]
+//
+//  Without --pt every electron pT bin of the histograms is fitted
+//  on its own.
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <iostream>
+#include "TFile.h"
+#include "TH1D.h"
+#include "NPEHTemplateFit.h"
+using namespace std;
+
+int main(int argc, char* argv[]) {
+
+  vector<string> args;
+  const char* ptText = 0;
+  const char* output = 0;
+  int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--pt") && i+1 < argc) ptText = argv[++i];
+    else if (!strcmp(argv[i], "--threads") && i+1 < argc) nThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--output") && i+1 < argc) output = argv[++i];
+    else args.push_back(argv[i]);
+  }
+  if (args.size() != 6 || nThreads < 1) {
+    cout << "Usage: " << argv[0] << " data.root dataHist B.root BHist C.root CHist"
+	 << " [--pt e0,e1,...] [--threads N] [--output fit.root]" << endl;
+    return 2;
+  }
+
+  TH2 *hData = readTemplate(args[0].c_str(), args[1].c_str());
+  TH2 *hB = readTemplate(args[2].c_str(), args[3].c_str());
+  TH2 *hC = readTemplate(args[4].c_str(), args[5].c_str());
+  if (!hData || !hB || !hC) return 1;
+  if (!sameBinning(hB, hData) || !sameBinning(hC, hData)) {
+    cout << "Error: data and templates have different binnings" << endl;
+    return 1;
+  }
+
+  vector<double> ptEdges;
+  if (ptText) {
+    if (!parsePtEdges(ptText, ptEdges)) {
+      cout << "Error: bad pT edges '" << ptText << "'" << endl;
+      return 2;
+    }
+  }
+  else {
+    TAxis *xAxis = hData->GetXaxis();
+    for (int ix = 1; ix <= xAxis->GetNbins(); ix++) ptEdges.push_back(xAxis->GetBinLowEdge(ix));
+    ptEdges.push_back(xAxis->GetBinUpEdge(xAxis->GetNbins()));
+  }
+
+  templateBins_t data, templB, templC;
+  projectTemplate(hData, ptEdges, data);
+  projectTemplate(hB, ptEdges, templB);
+  projectTemplate(hC, ptEdges, templC);
+
+  vector<templateFitTask_t> tasks(data.nPt);
+  for (int k = 0; k < data.nPt; k++) {
+    tasks[k].data = data.contentOf(k);
+    tasks[k].b = templB.contentOf(k);
+    tasks[k].b2 = templB.error2Of(k);
+    tasks[k].c = templC.contentOf(k);
+    tasks[k].c2 = templC.error2Of(k);
+    tasks[k].n = data.nPhi;
+  }
+
+  clock_t start = clock();
+  fitTemplatesParallel(tasks, nThreads);
+  cout << data.nPt << " pT bins fitted in " << static_cast<double>(clock() - start)/CLOCKS_PER_SEC
+       << " s CPU with up to " << nThreads << " threads" << endl;
+
+  //
+  //  Table of the results
+  //
+  int nFailed = 0;
+  char line[256];
+  sprintf(line, "%7s %7s %10s %10s %10s %10s %8s %8s %9s %4s %s",
+	  "pT low", "pT high", "nB", "dnB", "nC", "dnC", "fB", "dfB", "deviance", "ndf", "status");
+  cout << line << endl;
+  for (int k = 0; k < data.nPt; k++) {
+    const templateFitResult_t &r = tasks[k].result;
+    if (r.status != 0) nFailed++;
+    sprintf(line, "%7.2f %7.2f %10.4g %10.4g %10.4g %10.4g %8.4f %8.4f %9.2f %4d %s",
+	    ptEdges[k], ptEdges[k+1], r.nB, r.nBError, r.nC, r.nCError, r.fB, r.fBError,
+	    r.deviance, r.ndf, r.status == 0 ? "ok" : r.status == 1 ? "not converged" : "empty");
+    cout << line << endl;
+  }
+
+  if (output) {
+    TFile *file = TFile::Open(output, "RECREATE");
+    if (!file || file->IsZombie()) {
+      cout << "Error: cannot write '" << output << "'" << endl;
+      return 1;
+    }
+    TH1D *hFraction = new TH1D("fitFractionB", "B fraction;p_{T}^{e} (GeV/c);f_{B}", data.nPt, &ptEdges[0]);
+    TH1D *hDeviance = new TH1D("fitDeviance", "deviance/ndf;p_{T}^{e} (GeV/c);deviance/ndf", data.nPt, &ptEdges[0]);
+    for (int k = 0; k < data.nPt; k++) {
+      const templateFitResult_t &r = tasks[k].result;
+      if (r.status == 2) continue;
+      hFraction->SetBinContent(k+1, r.fB);
+      hFraction->SetBinError(k+1, r.fBError);
+      if (r.ndf > 0) hDeviance->SetBinContent(k+1, r.deviance/r.ndf);
+    }
+    file->Write();
+    file->Close();
+    cout << "Fractions written to '" << output << "'" << endl;
+  }
+  return nFailed ? 3 : 0;
+}
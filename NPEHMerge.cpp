@@ -0,0 +1,47 @@
+//==============================================================================
+//  NPEHMerge.cpp
+//
+//  Merges the template files of a campaign (NpeBHcorr_*.root,
+//  NpeCHcorr_*.root, ...) into one file. Empty, unreadable and
+//  truncated inputs are reported and skipped; see NPEHMerge.h.
+//
+//  Usage: NPEHMerge output.root [--jobs N] input.root ...
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#include <ctime>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <iostream>
+#include "NPEHMerge.h"
+using namespace std;
+
+int main(int argc, char* argv[]) {
+
+  vector<string> args;
+  int nJobs = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--jobs") && i+1 < argc) nJobs = atoi(argv[++i]);
+    else args.push_back(argv[i]);
+  }
+  if (args.size() < 2 || nJobs < 1) {
+    cout << "Usage: " << argv[0] << " output.root [--jobs N] input.root ..." << endl;
+    return 2;
+  }
+  string output = args[0];
+  vector<string> inputs(args.begin()+1, args.end());
+
+  time_t start = time(0);
+  cout << "Merging " << inputs.size() << " files into '" << output << "' with up to "
+       << nJobs << " processes" << endl;
+  int nMerged = mergeHistogramFiles(inputs, output, nJobs);
+  if (nMerged < 0) {
+    cout << "Error: merge failed, '" << output << "' is incomplete" << endl;
+    return 1;
+  }
+  cout << nMerged << " of " << inputs.size() << " files merged in "
+       << time(0) - start << " s" << endl;
+  return nMerged == static_cast<int>(inputs.size()) ? 0 : 3;
+}
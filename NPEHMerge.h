@@ -0,0 +1,187 @@
+//==============================================================================
+//  NPEHMerge.h
+//
+//  Merging of template files (histos2D<name>N, histo3D<name>N and
+//  any other histogram in the top directory) without hadd.
+//
+//  The inputs are checked first: empty files, files ROOT cannot
+//  open and files it had to recover (jobs evicted while writing)
+//  are reported and left out. The rest is merged as a two-level
+//  tree: nWorkers forked processes each merge a share of the files
+//  into a partial file, the calling process then merges the
+//  partials. ROOT 5 is not thread-safe, hence processes instead of
+//  threads. Within a merge the histograms are done one key at a
+//  time, so at most one input histogram and the sum are in memory
+//  however many files there are.
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#ifndef NPEHMerge_h
+#define NPEHMerge_h
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <set>
+#include <iostream>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "TFile.h"
+#include "TKey.h"
+#include "TList.h"
+#include "TH1.h"
+
+//
+//  True if the file is a complete ROOT file; otherwise 'why'
+//  says what is wrong with it.
+//
+inline bool isMergeableFile(const std::string &name, std::string &why)
+{
+  struct stat st;
+  if (stat(name.c_str(), &st)) {
+    why = "missing";
+    return false;
+  }
+  if (st.st_size == 0) {
+    why = "empty";
+    return false;
+  }
+  TFile *file = TFile::Open(name.c_str(), "READ");
+  bool ok = file && !file->IsZombie();
+  if (!ok) why = "not a readable ROOT file";
+  else if (file->TestBit(TFile::kRecovered)) {
+    why = "truncated (recovered by ROOT)";
+    ok = false;
+  }
+  if (file) file->Close();
+  delete file;
+  return ok;
+}
+
+//
+//  Sum all histograms of the input files into 'output'. The key
+//  list of the first input defines what is merged; a histogram
+//  missing in another input is reported and that input skipped
+//  for it. Returns false if nothing could be written.
+//
+inline bool mergeFilesSerial(const std::vector<std::string> &inputs, const std::string &output)
+{
+  if (inputs.empty()) return false;
+  TDirectory *saveDir = gDirectory;
+  std::vector<TFile*> files;
+  for (unsigned int i = 0; i < inputs.size(); i++) {
+    files.push_back(TFile::Open(inputs[i].c_str(), "READ"));
+    if (!files.back() || files.back()->IsZombie()) {
+      std::cout << "Error: cannot open '" << inputs[i] << "' for merging" << std::endl;
+      for (unsigned int k = 0; k < files.size(); k++) delete files[k];
+      saveDir->cd();
+      return false;
+    }
+  }
+  TFile *out = new TFile(output.c_str(), "RECREATE");
+  if (out->IsZombie()) {
+    std::cout << "Error: cannot create '" << output << "'" << std::endl;
+    delete out;
+    for (unsigned int k = 0; k < files.size(); k++) delete files[k];
+    saveDir->cd();
+    return false;
+  }
+
+  TIter nextKey(files[0]->GetListOfKeys());
+  TKey *key;
+  std::set<std::string> done;
+  while ((key = static_cast<TKey*>(nextKey()))) {
+    if (!done.insert(key->GetName()).second) continue;   // older cycle of the same object
+    TObject *object = key->ReadObj();
+    if (!object->InheritsFrom("TH1")) {
+      delete object;
+      continue;
+    }
+    TH1 *sum = static_cast<TH1*>(object);
+    sum->SetDirectory(0);
+    for (unsigned int i = 1; i < files.size(); i++) {
+      TH1 *h = static_cast<TH1*>(files[i]->Get(key->GetName()));
+      if (!h) {
+	std::cout << "Warning: '" << key->GetName() << "' missing in '" << inputs[i] << "'" << std::endl;
+	continue;
+      }
+      sum->Add(h);
+      delete h;
+    }
+    out->cd();
+    sum->Write();
+    delete sum;
+  }
+  out->Close();
+  delete out;
+  for (unsigned int i = 0; i < files.size(); i++) {
+    files[i]->Close();
+    delete files[i];
+  }
+  saveDir->cd();
+  return true;
+}
+
+//
+//  Checks the inputs and merges the good ones with nWorkers
+//  processes. Returns the number of files merged, -1 on failure;
+//  merged (if given) returns their names.
+//
+inline int mergeHistogramFiles(const std::vector<std::string> &candidates, const std::string &output,
+			       int nWorkers, std::vector<std::string> *merged = 0)
+{
+  std::vector<std::string> scratch;
+  std::vector<std::string> &inputs = merged ? *merged : scratch;
+  inputs.clear();
+  std::string why;
+  for (unsigned int i = 0; i < candidates.size(); i++) {
+    if (isMergeableFile(candidates[i], why)) inputs.push_back(candidates[i]);
+    else std::cout << "Skipping '" << candidates[i] << "': " << why << std::endl;
+  }
+  if (inputs.empty()) return -1;
+
+  //
+  //  Too few files per worker is not worth a process
+  //
+  if (nWorkers > static_cast<int>(inputs.size())/2) nWorkers = inputs.size()/2;
+  if (nWorkers <= 1) return mergeFilesSerial(inputs, output) ? inputs.size() : -1;
+
+  std::cout.flush();
+  std::vector<std::string> partials;
+  std::vector<pid_t> pids;
+  char text[32];
+  for (int w = 0; w < nWorkers; w++) {
+    std::vector<std::string> share;
+    for (unsigned int i = w; i < inputs.size(); i += nWorkers) share.push_back(inputs[i]);
+    sprintf(text, ".part%d", w);
+    partials.push_back(output + text);
+    pid_t pid = fork();
+    if (pid == 0) {
+      bool ok = mergeFilesSerial(share, partials.back());
+      std::cout.flush();
+      _exit(ok ? 0 : 1);
+    }
+    if (pid < 0) {
+      std::cout << "Error: cannot fork merge worker, merging serially" << std::endl;
+      for (unsigned int k = 0; k < pids.size(); k++) waitpid(pids[k], 0, 0);
+      for (unsigned int k = 0; k < partials.size(); k++) unlink(partials[k].c_str());
+      return mergeFilesSerial(inputs, output) ? inputs.size() : -1;
+    }
+    pids.push_back(pid);
+  }
+
+  bool ok = true;
+  for (unsigned int k = 0; k < pids.size(); k++) {
+    int status;
+    if (waitpid(pids[k], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      std::cout << "Error: merge worker " << k << " failed" << std::endl;
+      ok = false;
+    }
+  }
+  if (ok) ok = mergeFilesSerial(partials, output);
+  for (unsigned int k = 0; k < partials.size(); k++) unlink(partials[k].c_str());
+  return ok ? static_cast<int>(inputs.size()) : -1;
+}
+
+#endif
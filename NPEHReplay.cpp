@@ -0,0 +1,549 @@
+//==============================================================================
+//  NPEHReplay.cpp
+//
+//  Builds the NPE-h templates from events that already exist:
+//  HepMC 2 ASCII files (from any generator) or event records
+//  written by NPEHDelPhiCorr with NPE:saveEvents. The analysis is
+//  the one of NPEHDelPhiCorr (NPEHAnalysis.h), the output has the
+//  same histos2D<name><i> / histo3D<name><i> histograms.
+//
+//  The inputs are cut into chunks (byte ranges of the HepMC files,
+//  chunks of the record files) that worker threads take from a
+//  common queue. Each thread fills its own histograms, which are
+//  summed at the end.
+//
+//  Usage: NPEHReplay rootfile histName [--threads N] [--cuts S] input ...
+//         inputs ending in .npeev are event records, all others HepMC;
+//         S are extra cut sets as in NPE:cutSets
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#include <ctime>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "TFile.h"
+#include "TH2D.h"
+#include "TH3F.h"
+#include "NPEHAnalysis.h"
+using namespace std;
+
+//
+//  One unit of work: a byte range [begin, end) of a HepMC file
+//  (events whose E line starts in it) or a range of chunks of an
+//  event record.
+//
+struct replayChunk_t {
+  int  input;        // index into the input list
+  long begin;
+  long end;
+};
+
+//
+//  Inputs, work queue and results shared by the threads
+//
+struct replayJob_t {
+  vector<cutSet_t> cutSets;
+  vector<string> inputs;
+  vector<npeRecordReader_t*> records;   // 0 for HepMC inputs
+  vector<replayChunk_t> chunks;
+  unsigned int nextChunk;               // protected by mutex
+  pthread_mutex_t mutex;
+};
+
+struct replayThread_t {
+  int ithread;
+  replayJob_t *job;
+  vector<TH2D*> histos2D;
+  vector<TH3F*> histos3D;
+  long numberOfEvents;        // read
+  long numberOfAccepted;      // with a c/b electron in the acceptance
+  int  numberOfElectrons;
+};
+
+//
+//  A particle of a HepMC event, before it is turned into the
+//  snapshot the analysis works on
+//
+struct hepmcParticle_t {
+  int id;
+  int status;
+  int prodVertex;     // barcode, 0 if none
+  int endVertex;
+  double px, py, pz, e, m;
+};
+
+//
+//  Forward declarations
+//
+bool isRecordFile(const string&);
+void* replayThread(void*);
+void replayHepMC(const string&, long, long, replayThread_t&, eventSnapshot_t&);
+void replayRecords(const npeRecordReader_t&, long, long, replayThread_t&, eventSnapshot_t&);
+bool parseHepMCEvent(const string&, vector<string>&, vector<hepmcParticle_t>&, double&);
+bool checkHepMCParser();
+void hepmcToSnapshot(const vector<hepmcParticle_t>&, eventSnapshot_t&);
+int  pdgCharge3(int);
+bool isHeavyFlavorHadron(int);
+
+pthread_mutex_t coutMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int main(int argc, char* argv[]) {
+
+  //
+  //  rootfile histName first, then the inputs; options anywhere
+  //
+  vector<char*> args;
+  int nThreads = 1;
+  const char* cutSpec = "";
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i+1 < argc) nThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--cuts") && i+1 < argc) cutSpec = argv[++i];
+    else args.push_back(argv[i]);
+  }
+  replayJob_t job;
+  if (args.size() < 3 || nThreads < 1 || !parseCutSets(cutSpec, job.cutSets)) {
+    cout << "Usage: " << argv[0] << " rootfile histName [--threads N] [--cuts S] input ..." << endl;
+    cout << "       inputs ending in .npeev are event records, all others HepMC 2 ASCII" << endl;
+    return 2;
+  }
+  char* rootfile = args[0];
+  char* histname = args[1];
+  if (!checkHepMCParser()) {
+    cout << "Error: HepMC parser fails on a reference event, stopping" << endl;
+    return 1;
+  }
+
+  time_t now = time(0);
+  cout << "============================================================================" << endl;
+  cout << "Executing program '" << argv[0] << "', start at: " << ctime(&now);
+  cout << "Output: " << rootfile << " " << histname << ", " << args.size()-2
+       << " input files, " << nThreads << " threads" << endl;
+  cout << "============================================================================" << endl;
+
+  //
+  //  Cut the inputs into chunks. About four chunks per thread and
+  //  file keep the threads busy until the end.
+  //
+  job.nextChunk = 0;
+  pthread_mutex_init(&job.mutex, 0);
+  for (unsigned int k = 2; k < args.size(); k++) {
+    string name = args[k];
+    npeRecordReader_t *reader = 0;
+    long size;
+    if (isRecordFile(name)) {
+      reader = new npeRecordReader_t;
+      if (!reader->open(name)) {
+	cout << "Error: cannot read event record '" << name << "', skipped" << endl;
+	delete reader;
+	continue;
+      }
+      size = reader->nChunks();
+    }
+    else {
+      struct stat st;
+      if (stat(name.c_str(), &st)) {
+	cout << "Error: cannot open '" << name << "', skipped" << endl;
+	continue;
+      }
+      size = st.st_size;
+    }
+    long nChunks = 4*nThreads;
+    if (nChunks > size) nChunks = size;
+    for (long i = 0; i < nChunks; i++) {
+      replayChunk_t chunk;
+      chunk.input = job.inputs.size();
+      chunk.begin = size*i/nChunks;
+      chunk.end = size*(i+1)/nChunks;
+      job.chunks.push_back(chunk);
+    }
+    job.inputs.push_back(name);
+    job.records.push_back(reader);
+  }
+
+  TFile *hfile = new TFile(rootfile, "RECREATE");
+  vector<TH2D*> histos2D;
+  vector<TH3F*> histos3D;
+  bookHistograms(histos2D, histos3D, histname, job.cutSets.size());
+  enableWeights(histos2D, histos3D);
+
+  //
+  //  Per-thread histograms, as in NPEHDelPhiCorr --threads
+  //
+  vector<replayThread_t> threads(nThreads);
+  vector<pthread_t> tids(nThreads);
+  char text[64];
+  for (int it = 0; it < nThreads; it++) {
+    replayThread_t &thread = threads[it];
+    thread.ithread = it;
+    thread.job = &job;
+    for (unsigned int k = 0; k < histos2D.size(); k++) {
+      sprintf(text, "%s_t%d", histos2D[k]->GetName(), it);
+      thread.histos2D.push_back(static_cast<TH2D*>(histos2D[k]->Clone(text)));
+      thread.histos2D.back()->SetDirectory(0);
+    }
+    for (unsigned int k = 0; k < histos3D.size(); k++) {
+      sprintf(text, "%s_t%d", histos3D[k]->GetName(), it);
+      thread.histos3D.push_back(static_cast<TH3F*>(histos3D[k]->Clone(text)));
+      thread.histos3D.back()->SetDirectory(0);
+    }
+    pthread_create(&tids[it], 0, replayThread, &thread);
+  }
+
+  long numberOfEvents = 0;
+  long numberOfAccepted = 0;
+  int numberOfElectrons = 0;
+  for (int it = 0; it < nThreads; it++) {
+    pthread_join(tids[it], 0);
+    replayThread_t &thread = threads[it];
+    for (unsigned int k = 0; k < histos2D.size(); k++) {
+      histos2D[k]->Add(thread.histos2D[k]);
+      delete thread.histos2D[k];
+    }
+    for (unsigned int k = 0; k < histos3D.size(); k++) {
+      histos3D[k]->Add(thread.histos3D[k]);
+      delete thread.histos3D[k];
+    }
+    numberOfEvents += thread.numberOfEvents;
+    numberOfAccepted += thread.numberOfAccepted;
+    numberOfElectrons += thread.numberOfElectrons;
+  }
+  for (unsigned int k = 0; k < job.records.size(); k++) delete job.records[k];
+  pthread_mutex_destroy(&job.mutex);
+
+  cout << "# of events read = " << numberOfEvents
+       << ", with c/b electrons in the acceptance = " << numberOfAccepted
+       << ", # of electrons from c/b hadron decays = " << numberOfElectrons << endl;
+
+  cout << "Writing File" << endl;
+  hfile->Write();
+  hfile->Close();
+
+  now = time(0);
+  cout << "============================================================================" << endl;
+  cout << "Program finished at: " << ctime(&now);
+  cout << "============================================================================" << endl;
+  return 0;
+}
+
+bool isRecordFile(const string &name)
+{
+  return name.size() > 6 && name.compare(name.size()-6, 6, ".npeev") == 0;
+}
+
+//
+//  Thread body: take chunks from the queue until it is empty
+//
+void* replayThread(void* arg)
+{
+  replayThread_t &thread = *static_cast<replayThread_t*>(arg);
+  replayJob_t &job = *thread.job;
+  thread.numberOfEvents = thread.numberOfAccepted = 0;
+  thread.numberOfElectrons = 0;
+  eventSnapshot_t snapshot;
+
+  while (true) {
+    pthread_mutex_lock(&job.mutex);
+    unsigned int k = job.nextChunk++;
+    pthread_mutex_unlock(&job.mutex);
+    if (k >= job.chunks.size()) break;
+
+    const replayChunk_t &chunk = job.chunks[k];
+    if (job.records[chunk.input])
+      replayRecords(*job.records[chunk.input], chunk.begin, chunk.end, thread, snapshot);
+    else
+      replayHepMC(job.inputs[chunk.input], chunk.begin, chunk.end, thread, snapshot);
+  }
+
+  pthread_mutex_lock(&coutMutex);
+  cout << "[thread " << thread.ithread << "] " << thread.numberOfEvents << " events read, "
+       << thread.numberOfAccepted << " accepted" << endl;
+  pthread_mutex_unlock(&coutMutex);
+  return 0;
+}
+
+//
+//  Chunks [begin, end) of an event record
+//
+void replayRecords(const npeRecordReader_t &reader, long begin, long end,
+		   replayThread_t &thread, eventSnapshot_t &snapshot)
+{
+  int nParticles;
+  double weight;
+  for (long chunk = begin; chunk < end; chunk++) {
+    for (int i = 0; i < reader.nEvents(chunk); i++) {
+      const npeRecordParticle_t *particles = reader.event(chunk, i, nParticles, weight);
+      recordToSnapshot(particles, nParticles, snapshot);
+      thread.numberOfEvents++;
+      int n = analyzeEvent(snapshot, thread.histos2D, thread.histos3D, thread.job->cutSets, weight);
+      if (n == 0) continue;
+      thread.numberOfElectrons += n;
+      thread.numberOfAccepted++;
+    }
+  }
+}
+
+//
+//  All events of a HepMC file whose E line starts in the byte
+//  range [begin, end). The event that straddles 'end' is read to
+//  its end; the next chunk skips it since its E line is not in
+//  that chunk's range.
+//
+void replayHepMC(const string &name, long begin, long end,
+		 replayThread_t &thread, eventSnapshot_t &snapshot)
+{
+  ifstream in(name.c_str());
+  if (!in) {
+    pthread_mutex_lock(&coutMutex);
+    cout << "Error: cannot open '" << name << "'" << endl;
+    pthread_mutex_unlock(&coutMutex);
+    return;
+  }
+
+  //
+  //  Find the first line starting at or after 'begin'
+  //
+  string line;
+  long pos = 0;
+  if (begin > 0) {
+    in.seekg(begin-1);
+    getline(in, line);
+    pos = begin-1 + line.size() + 1;
+  }
+
+  vector<string> eventLines;
+  vector<hepmcParticle_t> particles;
+  double weight;
+  bool inEvent = false;
+  while (true) {
+    long lineStart = pos;
+    bool more = !getline(in, line).fail();
+    pos += line.size() + 1;
+    bool newEvent = !more || (line.size() > 1 && line[0] == 'E' && line[1] == ' ')
+      || line.compare(0, 9, "HepMC::IO") == 0;
+
+    if (newEvent && inEvent) {
+      if (parseHepMCEvent(name, eventLines, particles, weight)) {
+	hepmcToSnapshot(particles, snapshot);
+	thread.numberOfEvents++;
+	int n = analyzeEvent(snapshot, thread.histos2D, thread.histos3D, thread.job->cutSets, weight);
+	if (n > 0) {
+	  thread.numberOfElectrons += n;
+	  thread.numberOfAccepted++;
+	}
+      }
+      inEvent = false;
+    }
+    if (!more) break;
+    if (newEvent && line[0] == 'E') {
+      if (lineStart >= end) break;
+      inEvent = true;
+      eventLines.clear();
+    }
+    if (inEvent) eventLines.push_back(line);
+  }
+}
+
+//
+//  Parse the E, V and P lines of one event (HepMC 2 ASCII, the
+//  "IO_GenEvent" format). Particles listed after a V line come
+//  out of that vertex, except the first n_orphan ones which go in.
+//  The event weight is the first weight on the E line, 1 if there
+//  is none. The E line reads
+//    E number n_mpi scale alphaQCD alphaQED signal_process_id
+//      signal_vertex_barcode n_vertices beam1 beam2
+//      n_random [random states] n_weights [weights]
+//
+bool parseHepMCEvent(const string &name, vector<string> &lines, vector<hepmcParticle_t> &particles,
+		     double &weight)
+{
+  particles.clear();
+  weight = 1;
+  int vertex = 0;
+  int nOrphan = 0;
+  for (unsigned int k = 0; k < lines.size(); k++) {
+    istringstream is(lines[k]);
+    char type;
+    is >> type;
+    if (type == 'E') {
+      int number, nmpi, signal, signalVertex, nVertices, beam1, beam2, nRandom, nWeights;
+      double scale, aqcd, aqed;
+      is >> number >> nmpi >> scale >> aqcd >> aqed >> signal >> signalVertex >> nVertices
+	 >> beam1 >> beam2 >> nRandom;
+      long random;
+      for (int i = 0; i < nRandom; i++) is >> random;
+      is >> nWeights;
+      if (nWeights > 0) is >> weight;
+    }
+    else if (type == 'V') {
+      int id, nOut;
+      double x, y, z, ctau;
+      is >> vertex >> id >> x >> y >> z >> ctau >> nOrphan >> nOut;
+    }
+    else if (type == 'P') {
+      hepmcParticle_t p;
+      int barcode;
+      double theta, phi;
+      is >> barcode >> p.id >> p.px >> p.py >> p.pz >> p.e >> p.m >> p.status
+	 >> theta >> phi >> p.endVertex;
+      p.prodVertex = 0;
+      if (nOrphan > 0) nOrphan--;
+      else p.prodVertex = vertex;
+      particles.push_back(p);
+    }
+    else continue;
+    if (is.fail()) {
+      pthread_mutex_lock(&coutMutex);
+      cout << "Error: malformed line in '" << name << "', event skipped: " << lines[k] << endl;
+      pthread_mutex_unlock(&coutMutex);
+      return false;
+    }
+  }
+  return !particles.empty();
+}
+
+//
+//  Reference event as written by Pythia 8 through HepMC 2 (one
+//  random state, weight 0.82). A parser that miscounts the E line
+//  fields gets the weight wrong.
+//
+bool checkHepMCParser()
+{
+  vector<string> lines;
+  lines.push_back("E 1 7 9.1187600000000003e+01 1.2900000000000000e-01 7.5500000000000003e-03 102 -3 2 1 2 "
+		  "1 19780503 1 8.2000000000000006e-01");
+  lines.push_back("U GEV MM");
+  lines.push_back("V -1 0 0 0 0 0 2 1 0");
+  lines.push_back("P 1 2212 0 0 6.4999999999999932e+03 6.5000000000000000e+03 9.3827000000000005e-01 4 0 0 -1 0");
+  lines.push_back("P 2 2212 0 0 -6.4999999999999932e+03 6.5000000000000000e+03 9.3827000000000005e-01 4 3.1415926535897931e+00 0 -1 0");
+  lines.push_back("P 3 11 1.0e+00 0 2.0e+00 2.2360679774997898e+00 5.1099891000000003e-04 1 0 0 0 0");
+  vector<hepmcParticle_t> particles;
+  double weight;
+  return parseHepMCEvent("reference event", lines, particles, weight) &&
+    particles.size() == 3 && fabs(weight - 0.82) < 1e-12 && particles[2].id == 11 &&
+    particles[2].prodVertex == -1 && particles[0].prodVertex == 0;
+}
+
+//
+//  Same content as fillSnapshot() in NPEHDelPhiCorr: electrons
+//  and charged final-state particles. The mother of a particle
+//  is the first particle going into its production vertex; the
+//  c/b ancestor labels follow the mother chain upwards, as
+//  labelHeavyFlavorAncestors() does with the Pythia record.
+//  m0 is the generated mass, HepMC has no nominal masses.
+//
+void hepmcToSnapshot(const vector<hepmcParticle_t> &particles, eventSnapshot_t &snapshot)
+{
+  snapshot.clear();
+  int n = particles.size();
+
+  map<int,int> firstIn;     // vertex barcode -> first incoming particle
+  map<int,int> nIn;
+  for (int i = 0; i < n; i++) {
+    int v = particles[i].endVertex;
+    if (v == 0) continue;
+    if (firstIn.find(v) == firstIn.end()) firstIn[v] = i;
+    nIn[v]++;
+  }
+  vector<int> mother(n, -1);
+  for (int i = 0; i < n; i++) {
+    map<int,int>::const_iterator it = firstIn.find(particles[i].prodVertex);
+    if (particles[i].prodVertex != 0 && it != firstIn.end()) mother[i] = it->second;
+  }
+
+  //
+  //  Ancestor labels; -2 = not yet known. The chain is walked up
+  //  to the first known label and the result passed back down.
+  //
+  vector<int> &ancestor = snapshot.ancestorOfRecord;
+  ancestor.assign(n, -2);
+  vector<int> chain;
+  for (int i = 0; i < n; i++) {
+    chain.clear();
+    int j = i;
+    while (j >= 0 && ancestor[j] == -2 && chain.size() <= static_cast<unsigned int>(n)) {
+      chain.push_back(j);
+      j = mother[j];
+    }
+    for (int k = chain.size()-1; k >= 0; k--) {
+      int c = chain[k];
+      int m = mother[c];
+      if (m < 0 || ancestor[m] == -2) ancestor[c] = -1;   // no mother, or a loop
+      else if (ancestor[m] >= 0) ancestor[c] = ancestor[m];
+      else ancestor[c] = isHeavyFlavorHadron(particles[m].id) ? m : -1;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    const hepmcParticle_t &p = particles[i];
+    int charge3 = pdgCharge3(p.id);
+    bool electron = abs(p.id) == 11;
+    bool final = p.status == 1;
+    if (!electron && !(final && charge3 != 0)) continue;
+    int motherId = 0;
+    if (electron && mother[i] >= 0) {
+      if (nIn[p.prodVertex] > 1) snapshot.motherError = true;
+      else motherId = particles[mother[i]].id;
+    }
+    double pt = sqrt(p.px*p.px + p.py*p.py);
+    double pAbs = sqrt(pt*pt + p.pz*p.pz);
+    double eta = pt > 0 ? 0.5*log((pAbs + p.pz)/(pAbs - p.pz)) : (p.pz > 0 ? 20. : -20.);
+    double y = p.e > fabs(p.pz) ? 0.5*log((p.e + p.pz)/(p.e - p.pz)) : (p.pz > 0 ? 20. : -20.);
+    snapshot.index.push_back(i);
+    snapshot.id.push_back(p.id);
+    snapshot.status.push_back(final ? 1 : -abs(p.status));
+    snapshot.charge.push_back(charge3/3.);
+    snapshot.pt.push_back(pt);
+    snapshot.eta.push_back(eta);
+    snapshot.phi.push_back(atan2(p.py, p.px));
+    snapshot.y.push_back(y);
+    snapshot.m0.push_back(p.m);
+    snapshot.motherId.push_back(motherId);
+    snapshot.hfAncestor.push_back(ancestor[i]);
+    snapshot.hfAncestorFlavor.push_back(ancestor[i] >= 0 ? hfFlavor(particles[ancestor[i]].id) : 0);
+  }
+}
+
+//
+//  Three times the charge from the PDG code: leptons and bosons
+//  from a table, hadrons from their quark content. For mesons the
+//  down-type quark (d, s, b) with the larger code is the antiquark.
+//
+int pdgCharge3(int id)
+{
+  static const int quark3[7] = {0, -1, 2, -1, 2, -1, 2};   // d u s c b t
+  int aid = abs(id);
+  int sign = id > 0 ? 1 : -1;
+  int charge3 = 0;
+  if (aid <= 6) charge3 = quark3[aid];
+  else if (aid == 11 || aid == 13 || aid == 15) charge3 = -3;
+  else if (aid == 24 || aid == 37) charge3 = 3;
+  else if (aid > 100 && aid < 1000000) {
+    int q1 = (aid/1000) % 10;
+    int q2 = (aid/100) % 10;
+    int q3 = (aid/10) % 10;
+    if (q3 == 0 || q2 == 0 || q2 > 6 || q3 > 6 || q1 > 6) return 0;   // diquarks, special codes
+    if (q1 == 0) {      // meson
+      if (q2 == q3) return 0;
+      charge3 = (q2 % 2) ? quark3[q3] - quark3[q2] : quark3[q2] - quark3[q3];
+    }
+    else charge3 = quark3[q1] + quark3[q2] + quark3[q3];
+  }
+  return sign*charge3;
+}
+
+bool isHeavyFlavorHadron(int id)
+{
+  int aid = abs(id);
+  if (aid < 100 || (aid/10) % 10 == 0) return false;   // not a hadron, or a diquark
+  int flavor = hfFlavor(aid);
+  return flavor == 4 || flavor == 5;
+}
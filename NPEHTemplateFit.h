@@ -0,0 +1,413 @@
+//==============================================================================
+//  NPEHTemplateFit.h
+//
+//  Fit of the B fraction: a data delta-phi distribution is fitted
+//  with the sum of the B and C templates (histos2D<name>0, electron
+//  pT vs delta-phi), separately in each electron pT bin.
+//
+//  The likelihood is binned Poisson with the Barlow-Beeston "lite"
+//  treatment of the template statistics: one nuisance factor beta
+//  per delta-phi bin scales the prediction, constrained by a
+//  Gaussian with the relative statistical error of the prediction.
+//  beta is the root of a quadratic and is profiled analytically,
+//  so each likelihood evaluation is one branch-free pass over the
+//  bins. The two yields are found by Newton iterations with
+//  numerical derivatives; their errors come from the Hessian.
+//
+//  The fits are independent and are run by worker threads.
+//
+//  Author: Z.W. Miller
+//==============================================================================
+#ifndef NPEHTemplateFit_h
+#define NPEHTemplateFit_h
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "TFile.h"
+#include "TH2.h"
+
+//
+//  Delta-phi distributions of one histogram in electron pT bins:
+//  bin j of pT bin k is content[k*nPhi + j], its squared error
+//  error2[k*nPhi + j]
+//
+struct templateBins_t {
+  int nPt;
+  int nPhi;
+  std::vector<double> content;
+  std::vector<double> error2;
+  const double* contentOf(int k) const {return &content[k*nPhi];}
+  const double* error2Of(int k) const {return &error2[k*nPhi];}
+};
+
+struct templateFitResult_t {
+  int    status;        // 0 ok, 1 not converged, 2 no data or empty template
+  int    iterations;
+  double nB, nBError;   // fitted yields
+  double nC, nCError;
+  double fB, fBError;   // nB/(nB+nC)
+  double deviance;      // -2 ln(L/L_saturated), chi2-like
+  int    ndf;
+};
+
+//
+//  One fit: the data and the two templates (contents and squared
+//  errors) over n delta-phi bins
+//
+struct templateFitTask_t {
+  const double *data;
+  const double *b, *b2;
+  const double *c, *c2;
+  int n;
+  templateFitResult_t result;
+};
+
+//
+//  Reads a TH2 and detaches it from its file
+//
+inline TH2* readTemplate(const char* filename, const char* histname)
+{
+  TFile *file = TFile::Open(filename);
+  if (!file || file->IsZombie()) {
+    delete file;
+    std::cout << "Error: cannot open '" << filename << "'" << std::endl;
+    return 0;
+  }
+  TH2 *h = static_cast<TH2*>(file->Get(histname));
+  if (!h || !h->InheritsFrom("TH2")) {
+    std::cout << "Error: no 2D histogram '" << histname << "' in '" << filename << "'" << std::endl;
+    file->Close();
+    delete file;
+    return 0;
+  }
+  h->SetDirectory(0);
+  file->Close();
+  delete file;
+  return h;
+}
+
+//
+//  Electron pT edges "e0,e1,..." (increasing, at least two)
+//
+inline bool parsePtEdges(const char* text, std::vector<double> &edges)
+{
+  edges.clear();
+  char *end;
+  for (const char *p = text; *p; p = *end ? end+1 : end) {
+    edges.push_back(strtod(p, &end));
+    if (end == p || (*end && *end != ',')) return false;
+    if (edges.size() > 1 && edges.back() <= edges[edges.size()-2]) return false;
+  }
+  return edges.size() >= 2;
+}
+
+//
+//  True if a and b have the same bins in x (electron pT) and y
+//  (delta-phi): same number and the same edges. Equal bin counts
+//  alone would let e.g. a delta-phi axis starting at -pi pass
+//  against one starting at -pi/2.
+//
+inline bool sameAxis(TAxis *a, TAxis *b)
+{
+  if (a->GetNbins() != b->GetNbins()) return false;
+  double tolerance = 1e-6*(a->GetXmax() - a->GetXmin())/a->GetNbins();
+  for (int i = 1; i <= a->GetNbins(); i++)
+    if (fabs(a->GetBinLowEdge(i) - b->GetBinLowEdge(i)) > tolerance) return false;
+  return fabs(a->GetXmax() - b->GetXmax()) <= tolerance;
+}
+
+inline bool sameBinning(TH2 *a, TH2 *b)
+{
+  return sameAxis(a->GetXaxis(), b->GetXaxis()) && sameAxis(a->GetYaxis(), b->GetYaxis());
+}
+
+//
+//  Sums the x bins (electron pT) of h with low edge in [edge k,
+//  edge k+1) into pT bin k; the y axis (delta-phi) is kept.
+//  Without Sumw2 the squared errors are the contents.
+//
+inline void projectTemplate(TH2 *h, const std::vector<double> &ptEdges, templateBins_t &bins)
+{
+  TAxis *xAxis = h->GetXaxis();
+  bins.nPt = ptEdges.size() - 1;
+  bins.nPhi = h->GetNbinsY();
+  bins.content.assign(bins.nPt*bins.nPhi, 0.);
+  bins.error2.assign(bins.nPt*bins.nPhi, 0.);
+  for (int ix = 1; ix <= h->GetNbinsX(); ix++) {
+    double low = xAxis->GetBinLowEdge(ix) + 1e-9;
+    int k = std::upper_bound(ptEdges.begin(), ptEdges.end(), low) - ptEdges.begin() - 1;
+    if (k < 0 || k >= bins.nPt) continue;
+    for (int iy = 1; iy <= bins.nPhi; iy++) {
+      double error = h->GetBinError(ix, iy);
+      bins.content[k*bins.nPhi + iy-1] += h->GetBinContent(ix, iy);
+      bins.error2[k*bins.nPhi + iy-1] += error*error;
+    }
+  }
+}
+
+//
+//  Profiled prediction mu and constraint term of bins [i, end) of
+//  a task, stored from index 0 of mu and penalty. beta comes from
+//  d(-ln L)/d(beta) = 0:
+//    beta^2 + (m s2 - 1) beta - d s2 = 0
+//  with m the prediction and s2 its relative variance; of the two
+//  forms of the root the one without cancellation is taken. With
+//  AVX2 four bins are done per instruction (both forms computed,
+//  then blended), the rest with the scalar loop.
+//
+inline void templateBinTerms(const templateFitTask_t &task, int i, int end, double scaleB, double scaleC,
+			     double* mu, double* penalty)
+{
+  int j = 0;
+
+#ifdef __AVX2__
+  const __m256d vscaleB = _mm256_set1_pd(scaleB);
+  const __m256d vscaleC = _mm256_set1_pd(scaleC);
+  const __m256d vscaleB2 = _mm256_set1_pd(scaleB*scaleB);
+  const __m256d vscaleC2 = _mm256_set1_pd(scaleC*scaleC);
+  const __m256d vtiny = _mm256_set1_pd(1e-300);
+  const __m256d vzero = _mm256_setzero_pd();
+  const __m256d vone = _mm256_set1_pd(1.);
+  const __m256d vtwo = _mm256_set1_pd(2.);
+  const __m256d vfour = _mm256_set1_pd(4.);
+  const __m256d vhalf = _mm256_set1_pd(0.5);
+  for (; i+4 <= end; i += 4, j += 4) {
+    __m256d m = _mm256_add_pd(_mm256_mul_pd(vscaleB, _mm256_loadu_pd(task.b+i)),
+			      _mm256_mul_pd(vscaleC, _mm256_loadu_pd(task.c+i)));
+    __m256d var = _mm256_add_pd(_mm256_mul_pd(vscaleB2, _mm256_loadu_pd(task.b2+i)),
+				_mm256_mul_pd(vscaleC2, _mm256_loadu_pd(task.c2+i)));
+    m = _mm256_max_pd(m, vtiny);
+    __m256d s2 = _mm256_div_pd(var, _mm256_mul_pd(m, m));
+    __m256d d = _mm256_loadu_pd(task.data+i);
+    __m256d a = _mm256_sub_pd(_mm256_mul_pd(m, s2), vone);
+    __m256d ds2 = _mm256_mul_pd(d, s2);
+    __m256d root = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(vfour, ds2)));
+    __m256d betaPos = _mm256_div_pd(_mm256_mul_pd(vtwo, ds2), _mm256_add_pd(a, root));
+    __m256d betaNeg = _mm256_mul_pd(vhalf, _mm256_sub_pd(root, a));
+    __m256d beta = _mm256_blendv_pd(betaNeg, betaPos, _mm256_cmp_pd(a, vzero, _CMP_GT_OQ));
+    _mm256_storeu_pd(mu+j, _mm256_max_pd(_mm256_mul_pd(beta, m), vtiny));
+    __m256d pull = _mm256_sub_pd(beta, vone);
+    __m256d pen = _mm256_div_pd(_mm256_mul_pd(vhalf, _mm256_mul_pd(pull, pull)), s2);
+    _mm256_storeu_pd(penalty+j, _mm256_and_pd(_mm256_cmp_pd(s2, vzero, _CMP_GT_OQ), pen));
+  }
+#endif
+
+  for (; i < end; i++, j++) {
+    double m = scaleB*task.b[i] + scaleC*task.c[i];
+    double var = scaleB*scaleB*task.b2[i] + scaleC*scaleC*task.c2[i];
+    m = m > 1e-300 ? m : 1e-300;
+    double s2 = var/(m*m);                        // relative variance of the prediction
+    double d = task.data[i];
+    double a = m*s2 - 1;
+    double root = sqrt(a*a + 4*d*s2);
+    double beta = a > 0 ? 2*d*s2/(a + root) : 0.5*(root - a);
+    double mu1 = beta*m;
+    mu[j] = mu1 > 1e-300 ? mu1 : 1e-300;
+    double pull = beta - 1;
+    penalty[j] = s2 > 0 ? 0.5*pull*pull/s2 : 0.;
+  }
+}
+
+//
+//  -ln L for the yields (nB, nC), the beta of each bin profiled
+//  out, up to a constant. sumB and sumC normalize the templates.
+//  The bins go through templateBinTerms() in blocks; the log stays
+//  a scalar loop, as there is no vector log in the compilers we
+//  use without -ffast-math or SVML, and the sum keeps the bin
+//  order so that both paths give the same result.
+//
+inline double templateNLL(const templateFitTask_t &task, double sumB, double sumC, double nB, double nC)
+{
+  const int block = 64;
+  const double scaleB = nB/sumB;
+  const double scaleC = nC/sumC;
+  double mu[block], penalty[block];
+  double nll = 0;
+  for (int i = 0; i < task.n; i += block) {
+    int end = std::min(i + block, task.n);
+    templateBinTerms(task, i, end, scaleB, scaleC, mu, penalty);
+    for (int j = 0; j < end - i; j++) nll += mu[j] - task.data[i+j]*log(mu[j]) + penalty[j];
+  }
+  return nll;
+}
+
+//
+//  Gradient and Hessian of templateNLL by central differences with
+//  relative step eps. Close to the boundary the point is moved
+//  inside by one step so that no yield becomes negative.
+//
+inline void templateDerivatives(const templateFitTask_t &task, double sumB, double sumC,
+				const double x[2], double eps, double g[2], double hess[3])
+{
+  double h[2] = {eps*std::max(x[0], 1.), eps*std::max(x[1], 1.)};
+  double xB = std::max(x[0], h[0]);
+  double xC = std::max(x[1], h[1]);
+  double f0 = templateNLL(task, sumB, sumC, xB, xC);
+  double fpB = templateNLL(task, sumB, sumC, xB+h[0], xC);
+  double fmB = templateNLL(task, sumB, sumC, xB-h[0], xC);
+  double fpC = templateNLL(task, sumB, sumC, xB, xC+h[1]);
+  double fmC = templateNLL(task, sumB, sumC, xB, xC-h[1]);
+  g[0] = (fpB - fmB)/(2*h[0]);
+  g[1] = (fpC - fmC)/(2*h[1]);
+  hess[0] = (fpB - 2*f0 + fmB)/(h[0]*h[0]);
+  hess[1] = (fpC - 2*f0 + fmC)/(h[1]*h[1]);
+  hess[2] = (templateNLL(task, sumB, sumC, xB+h[0], xC+h[1]) - templateNLL(task, sumB, sumC, xB+h[0], xC-h[1])
+	     - templateNLL(task, sumB, sumC, xB-h[0], xC+h[1]) + templateNLL(task, sumB, sumC, xB-h[0], xC-h[1]))
+    /(4*h[0]*h[1]);
+}
+
+//
+//  Fit of one task; the result is stored in task.result
+//
+inline void fitTemplates(templateFitTask_t &task)
+{
+  templateFitResult_t &r = task.result;
+  r.status = 2;
+  r.iterations = 0;
+  r.nB = r.nC = r.fB = 0;
+  r.nBError = r.nCError = r.fBError = 0;
+  r.deviance = 0;
+  r.ndf = task.n - 2;
+
+  double sumD = 0, sumB = 0, sumC = 0;
+  for (int i = 0; i < task.n; i++) {
+    sumD += task.data[i];
+    sumB += task.b[i];
+    sumC += task.c[i];
+  }
+  if (sumD <= 0 || sumB <= 0 || sumC <= 0) return;
+
+  //
+  //  Newton iterations in (nB, nC) >= 0 with central differences.
+  //  A step that does not lower -ln L is halved; if the Hessian is
+  //  not positive definite, a gradient step is taken instead.
+  //
+  const int maxIterations = 200;
+  double x[2] = {0.5*sumD, 0.5*sumD};
+  double f = templateNLL(task, sumB, sumC, x[0], x[1]);
+  r.status = 1;
+  for (r.iterations = 1; r.iterations <= maxIterations; r.iterations++) {
+    double g[2], hess[3];
+    templateDerivatives(task, sumB, sumC, x, 1e-4, g, hess);
+    double hBB = hess[0], hCC = hess[1], hBC = hess[2];
+    double det = hBB*hCC - hBC*hBC;
+    double step[2];
+    if (hBB > 0 && det > 0) {
+      step[0] = -( hCC*g[0] - hBC*g[1])/det;
+      step[1] = -(-hBC*g[0] + hBB*g[1])/det;
+    }
+    else {
+      double norm = sqrt(g[0]*g[0] + g[1]*g[1]);
+      step[0] = norm > 0 ? -0.1*sumD*g[0]/norm : 0;
+      step[1] = norm > 0 ? -0.1*sumD*g[1]/norm : 0;
+    }
+
+    double xNew[2], fNew = f;
+    bool better = false;
+    for (int halving = 0; halving < 30 && !better; halving++) {
+      xNew[0] = std::max(x[0] + step[0], 0.);
+      xNew[1] = std::max(x[1] + step[1], 0.);
+      fNew = templateNLL(task, sumB, sumC, xNew[0], xNew[1]);
+      better = fNew <= f;
+      step[0] *= 0.5;
+      step[1] *= 0.5;
+    }
+    if (!better) {                     // no descent left: at the minimum
+      r.status = 0;
+      break;
+    }
+    double moved = fabs(xNew[0] - x[0]) + fabs(xNew[1] - x[1]);
+    double gained = f - fNew;
+    x[0] = xNew[0];
+    x[1] = xNew[1];
+    f = fNew;
+    if (gained < 1e-10*std::max(fabs(f), 1.) && moved < 1e-7*sumD) {
+      r.status = 0;
+      break;
+    }
+  }
+
+  //
+  //  Errors from the inverse Hessian at the minimum, the fraction
+  //  error by propagation including the correlation
+  //
+  r.nB = x[0];
+  r.nC = x[1];
+  double g[2], hess[3];
+  templateDerivatives(task, sumB, sumC, x, 1e-3, g, hess);
+  double hBB = hess[0], hCC = hess[1], hBC = hess[2];
+  double det = hBB*hCC - hBC*hBC;
+  double total = x[0] + x[1];
+  if (det > 0 && total > 0) {
+    double vBB = hCC/det, vCC = hBB/det, vBC = -hBC/det;
+    r.nBError = sqrt(vBB);
+    r.nCError = sqrt(vCC);
+    r.fB = x[0]/total;
+    double dB = x[1]/(total*total);       // d fB / d nB
+    double dC = -x[0]/(total*total);      // d fB / d nC
+    double vf = dB*dB*vBB + dC*dC*vCC + 2*dB*dC*vBC;
+    r.fBError = vf > 0 ? sqrt(vf) : 0;
+  }
+  else {
+    r.fB = total > 0 ? x[0]/total : 0;
+    if (r.status == 0) r.status = 1;
+  }
+
+  //
+  //  Deviance against the saturated model (mu = d in every bin)
+  //
+  double saturated = 0;
+  for (int i = 0; i < task.n; i++)
+    if (task.data[i] > 0) saturated += task.data[i] - task.data[i]*log(task.data[i]);
+  r.deviance = 2*(f - saturated);
+}
+
+//
+//  Worker pool: the threads take the next task from a shared index
+//
+struct templateFitPool_t {
+  std::vector<templateFitTask_t> *tasks;
+  unsigned int next;          // protected by mutex
+  pthread_mutex_t mutex;
+};
+
+inline void* templateFitThread(void* arg)
+{
+  templateFitPool_t &pool = *static_cast<templateFitPool_t*>(arg);
+  for (;;) {
+    pthread_mutex_lock(&pool.mutex);
+    unsigned int k = pool.next++;
+    pthread_mutex_unlock(&pool.mutex);
+    if (k >= pool.tasks->size()) break;
+    fitTemplates((*pool.tasks)[k]);
+  }
+  return 0;
+}
+
+//
+//  Fits all tasks with up to nThreads threads
+//
+inline void fitTemplatesParallel(std::vector<templateFitTask_t> &tasks, int nThreads)
+{
+  templateFitPool_t pool;
+  pool.tasks = &tasks;
+  pool.next = 0;
+  pthread_mutex_init(&pool.mutex, 0);
+  if (nThreads > static_cast<int>(tasks.size())) nThreads = tasks.size();
+  if (nThreads <= 1) templateFitThread(&pool);
+  else {
+    std::vector<pthread_t> threads(nThreads);
+    for (int it = 0; it < nThreads; it++) pthread_create(&threads[it], 0, templateFitThread, &pool);
+    for (int it = 0; it < nThreads; it++) pthread_join(threads[it], 0);
+  }
+  pthread_mutex_destroy(&pool.mutex);
+}
+
+#endif